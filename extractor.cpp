@@ -3,16 +3,72 @@
 //
 // CLI
 // ----
-// ./extractor <slides.pdf> [-o latex_regions]
+// ./extractor <slides.pdf | dir | 'glob*.pdf'>... [-o latex_regions]
+//             [--memory-mb 3072] [--cache-mb 512] [--render-cache DIR | --no-render-cache]
+//             [--render-cache-mb 4096] [--display 1600x1000] [--render-threads N] [--crop-dpi 600]
+//             [--writers 2] [--format png|pnm|webp] [--png-level 1] [--gray] [--no-save-crops]
+//             [--png-strategy default|filtered|huffman|rle|fixed]
+//             [--ocr-workers 2] [--ocr-batch 8] [--ocr-wait-ms 50]
+//             [--ocr-cache FILE | --no-ocr-cache] [--dedup-distance 4]
+//             [--stub-latency 2500:500] [--drain-seconds 10] [--boxes spec.json] [--headless]
+//             [--metrics FILE] [--metrics-interval 10] [--propose | --propose-text]
+//
+// inputs           : PDF files, directories (every *.pdf inside) and quoted wildcard
+//                    patterns. Several decks share one set of render, writer and
+//                    OCR threads, and each writes to <out>/<pdf name>/.
+//
+// --memory-mb      : limit for all rendered images held at once: cached slides and
+//                    tiles are evicted and crop rendering waits for the writer and
+//                    OCR to stay under it; the peak is reported (0 = no limit)
+// --cache-mb       : memory budget for rendered slides kept for back/forward navigation
+// --render-cache   : directory for raw rendered pages reused across sessions
+//                    (default: $XDG_CACHE_HOME/extractor/renders or ~/.cache/...);
+//                    --render-cache-mb limits its size, deleting the least
+//                    recently used pages beyond it (default 4096)
+// --display        : largest on-screen slide size
+// --render-threads : parallel MuPDF render threads (default: all cores)
+// --crop-dpi       : resolution crops are re-rendered at from the PDF (default 600)
+// --writers        : threads encoding and writing crops in the background
+// --no-save-crops  : hand crops to OCR in memory only, without writing image files
+// --format         : crop encoding: PNG, uncompressed binary PGM/PPM, or lossless WebP
+// --png-level      : zlib compression level for PNG crops (0 = store, 9 = smallest)
+// --png-strategy   : zlib strategy for PNG crops
+// --gray           : render crops as 1-channel grayscale
+// --ocr-workers    : number of parallel OCR workers
+// --ocr-batch      : most crops sent to the OCR backend in one call
+// --ocr-wait-ms    : how long a worker waits for a partial batch to fill up
+// --ocr-cache      : LaTeX of crops OCR'd by earlier runs, reused for identical crops
+//                    (default: $XDG_CACHE_HOME/extractor/ocr_results.tsv or ~/.cache/...)
+// --dedup-distance : crops whose 64-bit dHash differs in at most this many bits
+//                    from an earlier crop reuse its LaTeX (negative = OCR all)
+// --stub-latency   : simulated OCR cost per call and per crop, in ms
+// --drain-seconds  : on exit, how long queued and in-flight crops may still be
+//                    OCR'd; finished results are kept, the rest is redone next run
+// --boxes          : per-page boxes in PDF points for a single deck; preloads the
+//                    viewer. Without it a deck uses the boxes.json in its output
+//                    folder, which the GUI writes on exit, or <name>.boxes.json
+//                    next to the PDF.
+// --headless       : crop and OCR every deck's boxes without opening the GUI;
+//                    decks without boxes are skipped
+// --metrics        : Prometheus text file with per-stage latency histograms, counters
+//                    and queue depths, rewritten atomically with every [Metrics]
+//                    summary line; --metrics-interval sets the seconds between
+//                    those (0 = only at exit)
+// --propose        : pre-populate slides without saved boxes with detected
+//                    formula/text regions, to accept (q) or fix up
+// --propose-text   : like --propose, also using the PDF's text layer
 //
 // Key bindings inside the Slide Viewer window
 // ------------------------------------------
-// click-drag : draw a box
-// u          : undo last box
-// q          : save boxes & next slide
-// b          : save boxes & back one slide
-// c          : clear all boxes on current slide
-// Esc        : quit program
+// click-drag  : draw a box
+// right-click : delete the box under the cursor (e.g. a wrong proposal)
+// u           : undo last box
+// q           : save boxes & next slide
+// b           : save boxes & back one slide
+// c           : clear all boxes on current slide
+// wheel, + -  : zoom in / out (up to 800%), 0 : back to 100%
+// middle-drag : pan while zoomed
+// Esc         : quit program
 //
 // NOTE: This program depends on OpenCV (>= 4.0) and MuPDF.
 //       Compile with something like:
@@ -22,6 +78,7 @@
 //           -lmupdf -lmupdf-third -pthread
 //
 //       The exact MuPDF linkage flags depend on your distribution.
+//       `--format webp` needs an OpenCV build with WebP support (checked at startup).
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -29,14 +86,49 @@
 
 #include <mupdf/fitz.h>
 
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <chrono>
+#include <condition_variable>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
 #include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <future>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -51,6 +143,95 @@ struct ViewerConfig {
     static constexpr const char *TITLE_FMT = "%s - (%d / %d)"; // name, current, total
     static const inline cv::Scalar RECT_COLOR{0, 255, 0};      // BGR
     static constexpr int RECT_THICKNESS = 2;
+    static constexpr int POLL_MS = 30; // event-loop wait between redraw checks
+    static constexpr int DISPLAY_MAX_W = 1600; // slides are shown downscaled to fit
+    static constexpr int DISPLAY_MAX_H = 1000;
+    static constexpr std::array<double, 7> ZOOM_LEVELS = {1.0, 1.5, 2.0, 3.0, 4.0, 6.0, 8.0}; // up to 800%
+};
+
+// Rasterisation settings for the slide renderer
+struct RenderConfig {
+    static constexpr float DPI = 200.0f;
+    static constexpr float CROP_DPI = 600.0f;     // crops are re-rendered from the PDF at this DPI
+    static constexpr int PREFETCH_RADIUS = 1;     // slides kept ready on either side
+    static constexpr std::size_t CACHE_MB = 512;  // default rendered-slide budget
+    static constexpr std::size_t PAGE_LISTS = 16; // recorded display lists kept per deck
+    static constexpr int TILE_SIZE = 256;         // zoomed viewer tiles, px square
+    static constexpr std::size_t TILE_CACHE_MB = 128;
+    static constexpr std::size_t DISK_CACHE_MB = 4096; // on-disk render cache, shared by all decks
+};
+
+// Formula/text-block proposals, in display pixels
+struct ProposalConfig {
+    static constexpr int CLOSE_W = 15; // closing kernel: joins glyphs of a word or formula ...
+    static constexpr int CLOSE_H = 5;  // ... and adjacent lines of a block
+    static constexpr int MIN_W = 12;   // smaller components are specks or stray glyphs
+    static constexpr int MIN_H = 8;
+    static constexpr double MAX_PAGE_FRACTION = 0.5; // larger ones are frames or backgrounds
+    static constexpr int PAD = 3;                    // margin around the ink
+    static constexpr double CONTAINED = 0.8;         // overlap at which the smaller box is dropped
+};
+
+// OCR worker pool
+struct OcrConfig {
+    static constexpr int WORKERS = 2;
+    static constexpr std::size_t QUEUE_CAPACITY = 1024; // power of two
+    static constexpr int MAX_BATCH = 8;                 // crops per backend call
+    static constexpr auto MAX_WAIT = 50ms;              // how long a partial batch waits to fill
+    static constexpr auto STUB_BATCH_LATENCY = 2500ms;  // stub cost per call ...
+    static constexpr auto STUB_CROP_LATENCY = 500ms;    // ... plus per crop (1 crop = 3 s)
+    static constexpr int DEDUP_DISTANCE = 4;            // dHash bits two duplicates may differ in
+    static constexpr double DEDUP_ASPECT = 0.15;        // ... and relative aspect-ratio difference
+    static constexpr auto DRAIN_TIMEOUT = 10s;          // how long shutdown lets queued crops finish
+    static constexpr auto RESCAN_INTERVAL = 1s;         // crop folder rescans where there is no inotify
+};
+
+struct OcrOptions {
+    int workers = OcrConfig::WORKERS;
+    int max_batch = OcrConfig::MAX_BATCH;
+    std::chrono::milliseconds max_wait = OcrConfig::MAX_WAIT;
+    int dedup_distance = OcrConfig::DEDUP_DISTANCE; // < 0 = OCR every crop
+    fs::path result_cache;                          // results kept across runs; empty = none
+};
+
+// Crop encoding/writing pool
+struct WriterConfig {
+    static constexpr int THREADS = 2;
+    static constexpr std::size_t QUEUE_CAPACITY = 64; // crops waiting to be encoded
+};
+
+// Pipeline telemetry
+struct MetricsConfig {
+    static constexpr auto SUMMARY_INTERVAL = 10s; // between [Metrics] lines
+};
+
+// Memory budget for rendered images, tiles and queued crops
+struct MemoryConfig {
+    static constexpr std::size_t BUDGET_MB = 3072; // leaves room for MuPDF, OpenCV and the OS on 8 GB VMs
+    static constexpr double QUEUE_SHARE = 0.25;    // of it for crops waiting for the writer and OCR
+    static constexpr double TILE_SHARE = 0.2;      // of the rest for viewer tiles; slides get the remainder
+};
+
+// Batch runs over many decks
+struct BatchConfig {
+    static constexpr std::size_t OPEN_DECKS = 4;     // headless decks with crops in flight at once
+    static constexpr auto PROGRESS_INTERVAL = 5000ms; // OCR progress line while waiting at the end
+};
+
+enum class Colorspace { Bgr, Gray };
+
+struct RenderOptions {
+    int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    float crop_dpi = RenderConfig::CROP_DPI;
+    Colorspace crop_colorspace = Colorspace::Bgr;
+    std::size_t cache_bytes = RenderConfig::CACHE_MB << 20;
+    std::size_t tile_cache_bytes = RenderConfig::TILE_CACHE_MB << 20;
+    fs::path disk_cache_dir; // empty = no on-disk cache
+    std::uintmax_t disk_cache_bytes = static_cast<std::uintmax_t>(RenderConfig::DISK_CACHE_MB) << 20;
+    cv::Size display_max{ViewerConfig::DISPLAY_MAX_W, ViewerConfig::DISPLAY_MAX_H};
+    Colorspace colorspace = Colorspace::Bgr;
+    bool propose = false;      // compute box proposals for every rendered slide
+    bool propose_text = false; // ... also using the PDF's text layer
 };
 
 struct Key {
@@ -58,9 +239,48 @@ struct Key {
     static constexpr int PREV = 'b';  // save + back one slide
     static constexpr int UNDO = 'u';  // undo last box
     static constexpr int CLEAR = 'c'; // clear all boxes
+    static constexpr int ZOOM_IN = '+';
+    static constexpr int ZOOM_IN_ALT = '='; // '+' without shift
+    static constexpr int ZOOM_OUT = '-';
+    static constexpr int ZOOM_RESET = '0';
     static constexpr int ESC = 27;    // quit
 };
 
+// How crops are encoded on disk
+enum class CropFormat { Png, Pnm, Webp };
+
+struct EncodeOptions {
+    CropFormat format = CropFormat::Png;
+    int png_level = 1; // zlib level 0-9 (OpenCV's default)
+    int png_strategy = cv::IMWRITE_PNG_STRATEGY_DEFAULT;
+    bool grayscale = false; // 1-channel crops, rendered as gray by MuPDF
+
+    // File extension including the dot
+    std::string extension() const {
+        switch (format) {
+        case CropFormat::Pnm: return grayscale ? ".pgm" : ".ppm";
+        case CropFormat::Webp: return ".webp";
+        case CropFormat::Png: break;
+        }
+        return ".png";
+    }
+
+    std::vector<int> imwrite_params() const {
+        switch (format) {
+        case CropFormat::Pnm: return {cv::IMWRITE_PXM_BINARY, 1};
+        case CropFormat::Webp: return {cv::IMWRITE_WEBP_QUALITY, 101}; // > 100 selects lossless
+        case CropFormat::Png: break;
+        }
+        return {cv::IMWRITE_PNG_COMPRESSION, png_level, cv::IMWRITE_PNG_STRATEGY, png_strategy};
+    }
+};
+
+// Any crop file the extractor can produce
+static bool is_crop_file(const fs::path &path) {
+    const fs::path ext = path.extension();
+    return ext == ".png" || ext == ".pgm" || ext == ".ppm" || ext == ".webp";
+}
+
 // Cyclic list of dummy LaTeX snippets for the OCR worker
 static const std::vector<std::string> LATEX_SNIPPETS = {
     R"(\hat{y}=\sigma(Wx+b))",
@@ -75,250 +295,3359 @@ static const std::vector<std::string> LATEX_SNIPPETS = {
     R"(f(x)=\mathrm{sign}(w^Tx+b))"};
 
 static std::string next_latex_snippet() {
-    static std::size_t index = 0;
-    const std::string &s = LATEX_SNIPPETS[index % LATEX_SNIPPETS.size()];
-    ++index;
-    return s;
+    static std::atomic<std::size_t> index{0}; // shared by all OCR workers
+    return LATEX_SNIPPETS[index.fetch_add(1, std::memory_order_relaxed) % LATEX_SNIPPETS.size()];
 }
 
-// Simulated OCR worker thread
-void ocr_worker(const fs::path &folder, const std::atomic_bool &stop_flag) {
-    std::cout << "[OCR] Worker started\n";
-    while (!stop_flag.load()) {
-        if (!fs::exists(folder)) {
-            std::this_thread::sleep_for(2s);
-            continue;
+// 64-bit FNV-1a, continuing from `h`
+static constexpr std::uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+
+static std::uint64_t fnv1a(const void *data, std::size_t size, std::uint64_t h = FNV_OFFSET) {
+    const auto *p = static_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// FNV-1a over a file's contents
+static std::uint64_t hash_file(const fs::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot read " + path.string());
+    std::uint64_t h = FNV_OFFSET;
+    std::vector<char> buf(1 << 20);
+    while (in) {
+        in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+        h = fnv1a(buf.data(), static_cast<std::size_t>(in.gcount()), h);
+    }
+    return h;
+}
+
+// FNV-1a over an image's size, type and pixel rows (ignores row padding)
+static std::uint64_t hash_pixels(const cv::Mat &img) {
+    const int header[3] = {img.rows, img.cols, img.type()};
+    std::uint64_t h = fnv1a(header, sizeof(header));
+    for (int r = 0; r < img.rows; ++r) {
+        h = fnv1a(img.ptr(r), img.cols * img.elemSize(), h);
+    }
+    return h;
+}
+
+// 64-bit difference hash: the image shrunk to 9x8 gray, one bit per pair of
+// horizontally adjacent pixels (set if the left one is brighter). Renderings
+// of the same content differ in only a few bits, whatever their resolution.
+static std::uint64_t dhash(const cv::Mat &img) {
+    cv::Mat gray, small;
+    if (img.channels() == 3) {
+        cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+    } else {
+        gray = img;
+    }
+    cv::resize(gray, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+    std::uint64_t bits = 0;
+    for (int y = 0; y < 8; ++y) {
+        const unsigned char *row = small.ptr<unsigned char>(y);
+        for (int x = 0; x < 8; ++x) bits = (bits << 1) | (row[x] > row[x + 1] ? 1u : 0u);
+    }
+    return bits;
+}
+
+// dHashes searchable for those within `max_distance` bits of a query
+//
+// Multi-index hashing: the 64 bits are split into max_distance + 1 chunks, and
+// a hash that close must match the query exactly in at least one of them, so
+// only hashes sharing a chunk value with the query are compared. Not
+// synchronised.
+class DhashIndex {
+public:
+    // `max_distance` is in [0, 63]
+    explicit DhashIndex(int max_distance) : max_distance_(max_distance), chunks_(max_distance + 1) {
+        const int n = static_cast<int>(chunks_.size());
+        for (int c = 0; c < n; ++c) { // as even as possible
+            chunks_[c].shift = 64 * c / n;
+            chunks_[c].width = 64 * (c + 1) / n - chunks_[c].shift;
         }
-        bool work_found = false;
-        for (const auto &entry : fs::directory_iterator(folder)) {
-            if (stop_flag.load()) break;
-            if (entry.path().extension() != ".png") continue;
-            fs::path tex_path = entry.path().replace_extension(".tex");
-            if (fs::exists(tex_path)) continue; // already processed
-            work_found = true;
+    }
 
-            std::string latex = next_latex_snippet();
-            std::cout << "[OCR] Processing " << entry.path().filename().string()
-                      << " -> '" << latex << "'\n";
+    void insert(std::uint64_t hash, std::size_t id) {
+        for (Chunk &c : chunks_) c.buckets[c.of(hash)].push_back({hash, id});
+    }
 
-            // Simulate processing time (3 seconds in 30 × 100 ms steps)
-            for (int i = 0; i < 30 && !stop_flag.load(); ++i) {
-                std::this_thread::sleep_for(100ms);
+    // Ids of the indexed hashes within `max_distance` bits, ascending
+    std::vector<std::size_t> find(std::uint64_t hash) const {
+        std::vector<std::size_t> ids;
+        for (const Chunk &c : chunks_) {
+            auto it = c.buckets.find(c.of(hash));
+            if (it == c.buckets.end()) continue;
+            for (const auto &[other, id] : it->second) {
+                if (std::popcount(other ^ hash) <= max_distance_) ids.push_back(id);
             }
-            if (stop_flag.load()) break;
-            std::ofstream ofs(tex_path);
-            ofs << latex << '\n';
-            std::cout << "[OCR]   -> wrote " << tex_path.filename().string() << "\n";
-        }
-        if (!work_found) {
-            std::this_thread::sleep_for(1s);
         }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        return ids;
     }
-    std::cout << "[OCR] Worker shutting down\n";
+
+private:
+    struct Chunk {
+        int shift = 0;
+        int width = 0;
+        std::unordered_map<std::uint64_t, std::vector<std::pair<std::uint64_t, std::size_t>>> buckets;
+
+        std::uint64_t of(std::uint64_t hash) const {
+            return width == 64 ? hash : (hash >> shift) & ((std::uint64_t{1} << width) - 1);
+        }
+    };
+
+    int max_distance_;
+    std::vector<Chunk> chunks_;
+};
+
+// Flush `fd`'s data to disk; fdatasync (which skips unneeded metadata) is not
+// available everywhere, e.g. not declared on macOS
+static int sync_data(int fd) {
+#ifdef __linux__
+    return ::fdatasync(fd);
+#else
+    return ::fsync(fd);
+#endif
 }
 
-// Bounding-box annotation helper class
-class BoxDrawer {
+// Write `contents` to `path` via a temporary file, fsync and rename, so readers
+// (and a crash) see either the old file or the complete new one
+static bool write_file_atomic(const fs::path &path, const std::string &contents) {
+    fs::path tmp_path = path;
+    tmp_path += ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = ::write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size());
+    ok = ::fsync(fd) == 0 && ok;
+    ok = ::close(fd) == 0 && ok;
+    if (ok) ok = ::rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (!ok) ::unlink(tmp_path.c_str());
+    return ok;
+}
+
+// Latency histogram with fixed buckets (upper bounds in seconds), lock-free
+class Histogram {
 public:
-    BoxDrawer(const cv::Mat &img, int slide_num, int total_slides)
-        : original_(img.clone()), slide_num_(slide_num), total_slides_(total_slides) {
-        cv::namedWindow(ViewerConfig::WINDOW_NAME, cv::WINDOW_NORMAL);
-        cv::moveWindow(ViewerConfig::WINDOW_NAME, ViewerConfig::WINDOW_X, ViewerConfig::WINDOW_Y);
-        cv::setMouseCallback(ViewerConfig::WINDOW_NAME, &BoxDrawer::mouseCallback, this);
+    static constexpr std::array<double, 14> BOUNDS = {
+        0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0};
+
+    void observe(double seconds) {
+        auto bucket = std::lower_bound(BOUNDS.begin(), BOUNDS.end(), seconds) - BOUNDS.begin();
+        counts_[static_cast<std::size_t>(bucket)].fetch_add(1, std::memory_order_relaxed); // last = +Inf
+        sum_us_.fetch_add(static_cast<std::uint64_t>(std::llround(seconds * 1e6)), std::memory_order_relaxed);
     }
 
-    // Return value: "next", "back", or "quit"
-    std::string run(std::vector<std::pair<cv::Point, cv::Point>> &out_boxes) {
-        while (true) {
-            cv::Mat frame = original_.clone();
-            for (const auto &[p1, p2] : boxes_) {
-                cv::rectangle(frame, p1, p2, ViewerConfig::RECT_COLOR, ViewerConfig::RECT_THICKNESS);
-            }
-            char title[128];
-            std::snprintf(title, sizeof(title), ViewerConfig::TITLE_FMT,
-                ViewerConfig::WINDOW_NAME, slide_num_, total_slides_);
-            cv::setWindowTitle(ViewerConfig::WINDOW_NAME, title);
-            cv::imshow(ViewerConfig::WINDOW_NAME, frame);
-            int key = cv::waitKey(1);
-            if (key == Key::NEXT) {
-                out_boxes = boxes_;
-                return "next";
-            }
-            if (key == Key::PREV) {
-                out_boxes = boxes_;
-                return "back";
-            }
-            if (key == Key::ESC) {
-                out_boxes.clear();
-                return "quit";
-            }
-            if (key == Key::UNDO && !boxes_.empty()) {
-                boxes_.pop_back();
-            }
-            if (key == Key::CLEAR) {
-                boxes_.clear();
+    std::uint64_t count() const {
+        std::uint64_t n = 0;
+        for (const auto &c : counts_) n += c.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    // Upper bound of the bucket holding quantile `q`; infinity past the last bound
+    double quantile(double q) const {
+        const std::uint64_t n = count();
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < BOUNDS.size(); ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (n > 0 && static_cast<double>(seen) >= q * static_cast<double>(n)) return BOUNDS[i];
+        }
+        return n > 0 ? INFINITY : 0.0;
+    }
+
+    // Prometheus text exposition of this histogram as `name`
+    void write(std::string &out, const std::string &name, const char *help) const {
+        out += "# HELP " + name + " " + help + "\n# TYPE " + name + " histogram\n";
+        std::uint64_t cumulative = 0;
+        char line[160];
+        for (std::size_t i = 0; i <= BOUNDS.size(); ++i) {
+            cumulative += counts_[i].load(std::memory_order_relaxed);
+            if (i < BOUNDS.size()) {
+                std::snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name.c_str(), BOUNDS[i],
+                    static_cast<unsigned long long>(cumulative));
+            } else {
+                std::snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name.c_str(),
+                    static_cast<unsigned long long>(cumulative));
             }
+            out += line;
         }
+        std::snprintf(line, sizeof(line), "%s_sum %.6f\n%s_count %llu\n", name.c_str(),
+            static_cast<double>(sum_us_.load(std::memory_order_relaxed)) / 1e6, name.c_str(),
+            static_cast<unsigned long long>(cumulative));
+        out += line;
     }
 
 private:
-    static void mouseCallback(int event, int x, int y, int /*flags*/, void *userdata) {
-        auto *self = static_cast<BoxDrawer *>(userdata);
-        if (event == cv::EVENT_LBUTTONDOWN) {
-            self->start_ = {x, y};
-        } else if (event == cv::EVENT_LBUTTONUP && self->start_.has_value()) {
-            self->boxes_.emplace_back(*self->start_, cv::Point{x, y});
-            self->start_.reset();
+    std::array<std::atomic<std::uint64_t>, BOUNDS.size() + 1> counts_{};
+    std::atomic<std::uint64_t> sum_us_{0};
+};
+
+// Observes the time from construction to destruction into a histogram
+class StageTimer {
+public:
+    explicit StageTimer(Histogram &h) : h_(h), start_(std::chrono::steady_clock::now()) {}
+    ~StageTimer() { h_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count()); }
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+    Histogram &h_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Pipeline telemetry: per-stage latencies, throughput counters and queue depths
+struct Metrics {
+    Histogram slide_render; // page -> slide raster + display copy, on the render pool
+    Histogram slide_wait;   // time the GUI blocked waiting for a slide
+    Histogram tile_render;  // one zoomed-viewer tile
+    Histogram crop_render;  // box re-rendered at the crop DPI
+    Histogram crop_write;   // crop encoded and written by the CropWriter
+    Histogram ocr_batch;    // one backend call
+
+    std::atomic<std::uint64_t> slides_rendered{0};
+    std::atomic<std::uint64_t> render_cache_hits{0}; // slides loaded from the on-disk cache
+    std::atomic<std::uint64_t> crops_queued{0};
+    std::atomic<std::uint64_t> crops_written{0};
+    std::atomic<std::uint64_t> ocr_recognized{0}; // crops sent to the backend
+    std::atomic<std::uint64_t> ocr_cached{0};     // answered by the result cache
+    std::atomic<std::uint64_t> ocr_duplicates{0}; // answered by a near-duplicate
+
+    std::atomic<std::int64_t> render_queue{0}; // tasks waiting for a render thread
+    std::atomic<std::int64_t> writer_queue{0}; // crops waiting to be encoded
+    std::atomic<std::int64_t> ocr_queue{0};    // crops queued or being OCR'd
+
+    std::atomic<std::int64_t> memory_cached{0}; // bytes of cached slides and tiles
+    std::atomic<std::int64_t> memory_queued{0}; // bytes of crops waiting for the writer and OCR
+    std::atomic<std::int64_t> memory_peak{0};   // highest sum of the two so far
+
+    // Everything above in the Prometheus text format
+    std::string prometheus() const {
+        std::string out;
+        slide_render.write(out, "extractor_slide_render_seconds", "Slide rasterisation incl. display copy");
+        slide_wait.write(out, "extractor_slide_wait_seconds", "Time the viewer waited for a slide");
+        tile_render.write(out, "extractor_tile_render_seconds", "Zoomed viewer tile rendering");
+        crop_render.write(out, "extractor_crop_render_seconds", "Crop re-rendering at the crop DPI");
+        crop_write.write(out, "extractor_crop_write_seconds", "Crop encoding and writing");
+        ocr_batch.write(out, "extractor_ocr_batch_seconds", "OCR backend call per batch");
+        auto value = [&](const char *name, const char *type, const char *help, long long v) {
+            char line[256];
+            std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type,
+                name, v);
+            out += line;
+        };
+        auto counter = [&](const char *name, const char *help, const std::atomic<std::uint64_t> &c) {
+            value(name, "counter", help, static_cast<long long>(c.load()));
+        };
+        auto gauge = [&](const char *name, const char *help, const std::atomic<std::int64_t> &g) {
+            value(name, "gauge", help, static_cast<long long>(g.load()));
+        };
+        counter("extractor_slides_rendered_total", "Slides rendered", slides_rendered);
+        counter("extractor_render_cache_hits_total", "Slides loaded from the on-disk cache", render_cache_hits);
+        counter("extractor_crops_queued_total", "Crops queued for rendering", crops_queued);
+        counter("extractor_crops_written_total", "Crop images written", crops_written);
+        counter("extractor_ocr_recognized_total", "Crops sent to the OCR backend", ocr_recognized);
+        counter("extractor_ocr_cached_total", "Crops answered by the OCR result cache", ocr_cached);
+        counter("extractor_ocr_duplicates_total", "Crops answered by a near-duplicate", ocr_duplicates);
+        gauge("extractor_render_queue_depth", "Tasks waiting for a render thread", render_queue);
+        gauge("extractor_writer_queue_depth", "Crops waiting to be encoded", writer_queue);
+        gauge("extractor_ocr_queue_depth", "Crops queued or being OCR'd", ocr_queue);
+        gauge("extractor_memory_cached_bytes", "Cached slides and tiles", memory_cached);
+        gauge("extractor_memory_queued_bytes", "Crops waiting for the writer and OCR", memory_queued);
+        gauge("extractor_memory_peak_bytes", "Peak of cached plus queued bytes", memory_peak);
+        return out;
+    }
+};
+
+static Metrics &metrics() {
+    static Metrics instance;
+    return instance;
+}
+
+// Periodically prints a one-line summary of `metrics()` and, if `path` is
+// set, rewrites it there in the Prometheus text format (atomically, so a
+// node-exporter textfile collector never reads a partial file). Reports once
+// more on destruction.
+class MetricsReporter {
+public:
+    MetricsReporter(const fs::path &path, std::chrono::seconds interval) : path_(path), interval_(interval) {
+        if (interval_ > 0s) thread_ = std::thread(&MetricsReporter::loop, this);
+    }
+
+    ~MetricsReporter() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
         }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+        report();
     }
 
-    cv::Mat original_;
-    int slide_num_;
-    int total_slides_;
-    std::vector<std::pair<cv::Point, cv::Point>> boxes_;
-    std::optional<cv::Point> start_;
+    MetricsReporter(const MetricsReporter &) = delete;
+    MetricsReporter &operator=(const MetricsReporter &) = delete;
+
+private:
+    void loop() {
+        std::unique_lock lock(mutex_);
+        while (!cv_.wait_for(lock, interval_, [&] { return stop_; })) {
+            lock.unlock();
+            report();
+            lock.lock();
+        }
+    }
+
+    static std::string stage(const char *name, const Histogram &h) {
+        char buf[96];
+        std::snprintf(buf, sizeof(buf), "%s n=%llu p50<=%gms p95<=%gms", name,
+            static_cast<unsigned long long>(h.count()), h.quantile(0.5) * 1e3, h.quantile(0.95) * 1e3);
+        return buf;
+    }
+
+    void report() {
+        const Metrics &m = metrics();
+        const auto now = std::chrono::steady_clock::now();
+        const std::uint64_t ocr_done = m.ocr_recognized + m.ocr_cached + m.ocr_duplicates;
+        const double secs = std::chrono::duration<double>(now - last_time_).count();
+        const double ocr_rate = secs > 0 ? static_cast<double>(ocr_done - last_ocr_done_) / secs : 0.0;
+        last_time_ = now;
+        last_ocr_done_ = ocr_done;
+
+        char tail[224];
+        std::snprintf(tail, sizeof(tail),
+            " | queues render=%lld writer=%lld ocr=%lld | mem %lldMB (peak %lldMB) | OCR %.2f crops/s",
+            static_cast<long long>(m.render_queue.load()), static_cast<long long>(m.writer_queue.load()),
+            static_cast<long long>(m.ocr_queue.load()),
+            static_cast<long long>((m.memory_cached + m.memory_queued) >> 20),
+            static_cast<long long>(m.memory_peak.load() >> 20), ocr_rate);
+        std::cout << "[Metrics] " << stage("slide", m.slide_render) << " | " << stage("wait", m.slide_wait) << " | "
+                  << stage("crop", m.crop_render) << " | " << stage("write", m.crop_write) << " | "
+                  << stage("ocr", m.ocr_batch) << tail << "\n";
+
+        if (!path_.empty() && !write_file_atomic(path_, m.prometheus())) {
+            std::cerr << "[Metrics] Failed to write " << path_ << "\n";
+        }
+    }
+
+    fs::path path_;
+    std::chrono::seconds interval_;
+    std::chrono::steady_clock::time_point last_time_ = std::chrono::steady_clock::now();
+    std::uint64_t last_ocr_done_ = 0;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread thread_;
 };
 
-// Save image crops for one slide
-static void save_crops(const cv::Mat &img,
-    const std::vector<std::pair<cv::Point, cv::Point>> &boxes,
-    int slide_idx,
-    const fs::path &out_dir) {
-    int h = img.rows;
-    int w = img.cols;
+// Process-wide budget for decoded images
+//
+// Two kinds of memory count against it. Rendered slides and viewer tiles sit
+// in the renderers' LRU caches, which take bytes with `try_cache` and evict
+// their own least recently used entries when that fails. Rendered crops that
+// wait for the writer and OCR hold a Lease, taken with `try_reserve` before
+// the crop is rendered. While the crops' share is used up it fails and the
+// renderer keeps the crop queued (never blocking a pool thread) until a
+// `subscribe`d listener hears of a released lease, which slows crop rendering
+// down to the pace of writing and OCR. Crops get MemoryConfig::QUEUE_SHARE of
+// the limit and the caches the rest, so together they stay under it. Slides and
+// tiles each have a fixed slice of the caches' share (TILE_SHARE), so a full
+// slide cache never leaves the zoomed viewer without room. The peak is kept
+// for reporting.
+//
+// Only pixel buffers are counted: MuPDF's store, display lists and a slide
+// the viewer still shows after its cache dropped it are not.
+class MemoryBudget {
+public:
+    // A queued crop's bytes, given back when the last holder lets go
+    class Lease {
+    public:
+        Lease(MemoryBudget &budget, std::size_t bytes) : budget_(budget), bytes_(bytes) {}
+        ~Lease() { budget_.release(bytes_); }
 
-    int crop_idx = 1;
-    for (const auto &[p1, p2] : boxes) {
-        int x1 = std::clamp(std::min(p1.x, p2.x), 0, w);
-        int x2 = std::clamp(std::max(p1.x, p2.x), 0, w);
-        int y1 = std::clamp(std::min(p1.y, p2.y), 0, h);
-        int y2 = std::clamp(std::max(p1.y, p2.y), 0, h);
-        if (x2 - x1 == 0 || y2 - y1 == 0) continue; // empty crop
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
 
-        cv::Mat crop = img(cv::Rect(x1, y1, x2 - x1, y2 - y1));
-        char fname[64];
-        std::snprintf(fname, sizeof(fname), "slide_%03d_crop_%d.png", slide_idx + 1, crop_idx++);
-        fs::path crop_path = out_dir / fname;
-        cv::imwrite(crop_path.string(), crop);
-        std::cout << "[GUI] Saved " << crop_path.filename().string() << "\n";
+    private:
+        MemoryBudget &budget_;
+        std::size_t bytes_;
+    };
+
+    // 0 = unlimited; set before anything is cached or reserved
+    void set_limit(std::size_t bytes) {
+        std::lock_guard lock(mutex_);
+        limit_ = bytes;
     }
-}
 
-// Annotate PDF deck & launch GUI
-static void annotate_pdf(const fs::path &pdf_path, const fs::path &out_dir) {
-    //  Open document
-    fz_context *ctx = fz_new_context(nullptr, nullptr, FZ_STORE_DEFAULT);
-    if (!ctx) throw std::runtime_error("Cannot create MuPDF context");
-    fz_register_document_handlers(ctx);
+    std::size_t peak() const {
+        std::lock_guard lock(mutex_);
+        return peak_;
+    }
 
-    fz_document *doc = nullptr;
-    try {
-        doc = fz_open_document(ctx, pdf_path.string().c_str());
-    } catch (...) {
-        fz_drop_context(ctx);
-        throw;
+    enum class Cache { Slides, Tiles };
+
+    // Count `bytes` of cache entry if the slice of `cache` has room for them
+    bool try_cache(std::size_t bytes, Cache cache) {
+        std::lock_guard lock(mutex_);
+        std::size_t &used = cached_[static_cast<std::size_t>(cache)];
+        if (limit_ > 0 && used + bytes > cache_limit(cache)) return false;
+        used += bytes;
+        update();
+        return true;
     }
-    int page_count = fz_count_pages(ctx, doc);
-    if (page_count <= 0) {
-        fz_drop_document(ctx, doc);
-        fz_drop_context(ctx);
-        throw std::runtime_error("PDF contains no pages");
+
+    void uncache(std::size_t bytes, Cache cache) {
+        std::lock_guard lock(mutex_);
+        cached_[static_cast<std::size_t>(cache)] -= bytes;
+        update();
     }
 
-    int slide_idx = 0;
-    while (slide_idx >= 0 && slide_idx < page_count) {
-        fz_page *page = fz_load_page(ctx, doc, slide_idx);
-        fz_matrix mtx = fz_scale(200.0 / 72.0, 200.0 / 72.0); // 200 dpi render
-        fz_rect bbox = fz_bound_page(ctx, page);
-        fz_rect bounds;
-        fz_transform_rect(&bounds, &bbox, &mtx);
-
-        fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), &bounds, nullptr, 0);
-        fz_device *dev = fz_new_draw_device(ctx, pix);
-        fz_run_page(ctx, page, dev, &mtx, nullptr);
-        fz_close_device(ctx, dev);
-        fz_drop_device(ctx, dev);
+    // Null while queued crops use up their share. A crop larger than the
+    // whole share still goes through once nothing else is queued.
+    std::shared_ptr<const Lease> try_reserve(std::size_t bytes) {
+        std::lock_guard lock(mutex_);
+        if (limit_ > 0 && queued_ > 0 && queued_ + bytes > queue_limit()) return nullptr;
+        queued_ += bytes;
+        update();
+        return std::make_shared<const Lease>(*this, bytes);
+    }
 
-        int w = fz_pixmap_width(ctx, pix);
-        int h = fz_pixmap_height(ctx, pix);
-        const unsigned char *samples = fz_pixmap_samples(ctx, pix);
+    // Call `listener` after every released lease, on the releasing thread,
+    // until `unsubscribe` returns
+    int subscribe(std::function<void()> listener) {
+        std::lock_guard lock(listeners_mutex_);
+        listeners_.emplace(next_listener_, std::move(listener));
+        return next_listener_++;
+    }
 
-        // MuPDF gives BGRA; convert to BGR (drop alpha)
-        cv::Mat img_rgba(h, w, CV_8UC4, const_cast<unsigned char *>(samples));
-        cv::Mat img_bgr;
-        cv::cvtColor(img_rgba, img_bgr, cv::COLOR_RGBA2BGR);
+    void unsubscribe(int id) {
+        std::lock_guard lock(listeners_mutex_);
+        listeners_.erase(id);
+    }
 
-        BoxDrawer drawer(img_bgr, slide_idx + 1, page_count);
-        std::vector<std::pair<cv::Point, cv::Point>> boxes;
-        std::string action = drawer.run(boxes);
+private:
+    void release(std::size_t bytes) {
+        {
+            std::lock_guard lock(mutex_);
+            queued_ -= bytes;
+            update();
+        }
+        std::lock_guard lock(listeners_mutex_);
+        for (const auto &[id, listener] : listeners_) listener();
+    }
 
-        if (action == "quit") {
-            fz_drop_pixmap(ctx, pix);
-            fz_drop_page(ctx, page);
-            break;
+    // Caller holds `mutex_`
+    std::size_t queue_limit() const { return static_cast<std::size_t>(limit_ * MemoryConfig::QUEUE_SHARE); }
+
+    // Caller holds `mutex_`
+    std::size_t cache_limit(Cache cache) const {
+        const double share = static_cast<double>(limit_ - queue_limit());
+        return static_cast<std::size_t>(cache == Cache::Tiles ? share * MemoryConfig::TILE_SHARE
+                                                              : share * (1.0 - MemoryConfig::TILE_SHARE));
+    }
+
+    // Caller holds `mutex_`
+    void update() {
+        const std::size_t cached = cached_[0] + cached_[1];
+        peak_ = std::max(peak_, cached + queued_);
+        metrics().memory_cached = static_cast<std::int64_t>(cached);
+        metrics().memory_queued = static_cast<std::int64_t>(queued_);
+        metrics().memory_peak = static_cast<std::int64_t>(peak_);
+    }
+
+    mutable std::mutex mutex_;
+    std::size_t limit_ = 0;
+    std::array<std::size_t, 2> cached_{}; // by Cache
+    std::size_t queued_ = 0;
+    std::size_t peak_ = 0;
+    std::mutex listeners_mutex_; // taken after, never while holding, `mutex_`
+    std::map<int, std::function<void()>> listeners_;
+    int next_listener_ = 0;
+};
+
+using MemoryLease = std::shared_ptr<const MemoryBudget::Lease>;
+
+static MemoryBudget &memory_budget() {
+    static MemoryBudget instance;
+    return instance;
+}
+
+// Append-only log of finished OCR results
+//
+// One line per crop: pixel hash, OCR time, crop file name (relative to the
+// output folder), LaTeX and a checksum of the line, tab separated with
+// backslash escapes. Batches are appended with a single write and fdatasync,
+// and lines whose checksum does not match (a torn write at crash time) are
+// skipped on load, so the journal never claims work that was not finished.
+class ResultsJournal {
+public:
+    struct Record {
+        std::uint64_t hash;
+        double ms;
+        std::string name;
+        std::string latex;
+    };
+
+    explicit ResultsJournal(const fs::path &path) : path_(path) {}
+
+    ~ResultsJournal() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    ResultsJournal(const ResultsJournal &) = delete;
+    ResultsJournal &operator=(const ResultsJournal &) = delete;
+
+    // Read every intact record; one sequential pass over the file
+    std::vector<Record> load() const {
+        std::vector<Record> records;
+        std::ifstream in(path_, std::ios::binary);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::size_t tab = line.rfind('\t');
+            if (tab == std::string::npos) continue;
+            char expected[17];
+            std::snprintf(expected, sizeof(expected), "%016llx",
+                static_cast<unsigned long long>(fnv1a(line.data(), tab + 1)));
+            if (line.compare(tab + 1, std::string::npos, expected) != 0) continue;
+
+            std::vector<std::string> fields = split(line.substr(0, tab));
+            if (fields.size() != 4) continue;
+            records.push_back({std::stoull(fields[0], nullptr, 16), std::stod(fields[1]),
+                unescape(fields[2]), unescape(fields[3])});
         }
-        if (!boxes.empty()) {
-            save_crops(img_bgr, boxes, slide_idx, out_dir);
+        return records;
+    }
+
+    void append(const std::vector<Record> &records) {
+        std::string buf;
+        for (const auto &rec : records) {
+            char head[64];
+            std::snprintf(head, sizeof(head), "%016llx\t%.1f\t",
+                static_cast<unsigned long long>(rec.hash), rec.ms);
+            std::string line = head + escape(rec.name) + '\t' + escape(rec.latex) + '\t';
+            char sum[17];
+            std::snprintf(sum, sizeof(sum), "%016llx",
+                static_cast<unsigned long long>(fnv1a(line.data(), line.size())));
+            buf += line + sum + '\n';
         }
-        if (action == "back" && slide_idx > 0) {
-            --slide_idx;
-        } else if (action == "next") {
-            ++slide_idx;
+
+        std::lock_guard lock(mutex_);
+        if (fd_ < 0) {
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd_ < 0) {
+                throw std::runtime_error("Cannot open journal " + path_.string() + ": " + std::strerror(errno));
+            }
+        }
+        if (::write(fd_, buf.data(), buf.size()) != static_cast<ssize_t>(buf.size()) || sync_data(fd_) != 0) {
+            throw std::runtime_error("Cannot append to journal " + path_.string() + ": " + std::strerror(errno));
+        }
+    }
+
+private:
+    static std::string escape(const std::string &s) {
+        std::string out;
+        out.reserve(s.size());
+        for (char c : s) {
+            if (c == '\\') {
+                out += "\\\\";
+            } else if (c == '\t') {
+                out += "\\t";
+            } else if (c == '\n') {
+                out += "\\n";
+            } else {
+                out += c;
+            }
         }
+        return out;
+    }
 
-        fz_drop_pixmap(ctx, pix);
-        fz_drop_page(ctx, page);
+    static std::string unescape(const std::string &s) {
+        std::string out;
+        out.reserve(s.size());
+        for (std::size_t i = 0; i < s.size(); ++i) {
+            if (s[i] != '\\' || i + 1 == s.size()) {
+                out += s[i];
+                continue;
+            }
+            char c = s[++i];
+            out += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+        }
+        return out;
     }
 
-    cv::destroyAllWindows();
-    fz_drop_document(ctx, doc);
-    fz_drop_context(ctx);
-}
+    static std::vector<std::string> split(const std::string &s) {
+        std::vector<std::string> fields;
+        std::size_t start = 0;
+        for (std::size_t tab; (tab = s.find('\t', start)) != std::string::npos; start = tab + 1) {
+            fields.push_back(s.substr(start, tab - start));
+        }
+        fields.push_back(s.substr(start));
+        return fields;
+    }
 
-// Basic command-line parsing (one positional + optional -o/--out)
-struct CmdLine {
-    fs::path pdf = "slides.pdf";
-    fs::path outdir = "latex_regions";
+    fs::path path_;
+    std::mutex mutex_;
+    int fd_ = -1;
 };
 
-static CmdLine parse_arguments(int argc, char *argv[]) {
-    CmdLine cl;
-    for (int i = 1; i < argc; ++i) {
-        std::string arg = argv[i];
-        if (arg == "-o" || arg == "--out") {
-            if (i + 1 < argc) {
-                cl.outdir = argv[++i];
-            } else {
-                throw std::invalid_argument("Option '-o/--out' expects a directory");
-            }
-        } else {
-            cl.pdf = arg;
+// Reports crop files that appear in a set of folders
+//
+// On Linux this is inotify (IN_CLOSE_WRITE / IN_MOVED_TO), so new crops are
+// seen as soon as their writer closes them. `wait` polls without a timeout,
+// so an idle folder wakes no thread at all; `interrupt` wakes a blocked
+// `wait` through an eventfd polled alongside it. Elsewhere it falls back to
+// rescanning the folders every RESCAN_INTERVAL, which is not free when idle.
+class CropWatcher {
+public:
+    explicit CropWatcher(const fs::path &folder) {
+#ifdef __linux__
+        fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd_ < 0) throw std::runtime_error(std::string("Cannot start inotify: ") + std::strerror(errno));
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            ::close(fd_);
+            throw std::runtime_error(std::string("Cannot create eventfd: ") + std::strerror(errno));
         }
+#endif
+        add(folder);
     }
-    return cl;
-}
 
-// Program entry
-int main(int argc, char *argv[]) {
-    try {
-        std::cout << "Annotate LaTeX regions in a PDF deck of slides.\n";
-        CmdLine cmd = parse_arguments(argc, argv);
-        cmd.pdf = fs::absolute(cmd.pdf);
-        cmd.outdir = fs::absolute(cmd.outdir);
+    ~CropWatcher() {
+#ifdef __linux__
+        if (fd_ >= 0) ::close(fd_);
+        if (wake_fd_ >= 0) ::close(wake_fd_);
+#endif
+    }
 
-        if (!fs::exists(cmd.pdf)) {
-            std::cerr << "PDF file not found: " << cmd.pdf << "\n";
-            return 1;
+    CropWatcher(const CropWatcher &) = delete;
+    CropWatcher &operator=(const CropWatcher &) = delete;
+
+    // Also watch `folder`; safe to call while another thread is in `wait`
+    void add(const fs::path &folder) {
+        std::lock_guard lock(mutex_);
+#ifdef __linux__
+        int wd = inotify_add_watch(fd_, folder.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) throw std::runtime_error("Cannot watch " + folder.string() + ": " + std::strerror(errno));
+#else
+        int wd = static_cast<int>(folders_.size());
+#endif
+        folders_[wd] = folder;
+    }
+
+    // One-time listing of the crops already in `folder`. Call after `add` so
+    // that nothing written in between is missed (duplicates are possible).
+    static std::vector<fs::path> scan(const fs::path &folder) {
+        std::vector<fs::path> found;
+        for (const auto &entry : fs::directory_iterator(folder)) {
+            if (is_crop_file(entry.path())) found.push_back(entry.path());
         }
-        fs::create_directories(cmd.outdir);
+        return found;
+    }
+
+    // Make a blocked `wait`, and every later one, return at once
+    void interrupt() {
+#ifdef __linux__
+        const std::uint64_t one = 1;
+        [[maybe_unused]] ssize_t n = ::write(wake_fd_, &one, sizeof(one));
+#else
+        {
+            std::lock_guard lock(mutex_);
+            interrupted_ = true;
+        }
+        wake_cv_.notify_all();
+#endif
+    }
+
+    // Block until new crops show up; returns nothing once interrupted
+    std::vector<fs::path> wait() {
+        std::vector<fs::path> found;
+#ifdef __linux__
+        pollfd pfds[2] = {{fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+        if (::poll(pfds, 2, -1) <= 0 || (pfds[1].revents & POLLIN)) return found;
+
+        alignas(inotify_event) char buf[4096];
+        ssize_t len;
+        while ((len = ::read(fd_, buf, sizeof(buf))) > 0) {
+            std::lock_guard lock(mutex_);
+            for (char *p = buf; p < buf + len;) {
+                auto *ev = reinterpret_cast<inotify_event *>(p);
+                p += sizeof(inotify_event) + ev->len;
+                if (ev->len == 0 || ev->name[0] == '.') continue;
+                auto folder = folders_.find(ev->wd);
+                if (folder == folders_.end()) continue;
+                fs::path path = folder->second / ev->name;
+                if (is_crop_file(path)) found.push_back(std::move(path));
+            }
+        }
+#else
+        std::map<int, fs::path> folders;
+        {
+            std::unique_lock lock(mutex_);
+            if (wake_cv_.wait_for(lock, OcrConfig::RESCAN_INTERVAL, [&] { return interrupted_; })) return found;
+            folders = folders_;
+        }
+        for (const auto &[wd, folder] : folders) {
+            std::vector<fs::path> more = scan(folder);
+            found.insert(found.end(), std::make_move_iterator(more.begin()), std::make_move_iterator(more.end()));
+        }
+#endif
+        return found;
+    }
 
-        std::atomic_bool stop_flag{false};
-        std::thread worker(ocr_worker, cmd.outdir, std::ref(stop_flag));
+private:
+    std::mutex mutex_;
+    std::map<int, fs::path> folders_; // by inotify watch descriptor
+#ifdef __linux__
+    int fd_ = -1;
+    int wake_fd_ = -1; // eventfd written by `interrupt`
+#else
+    std::condition_variable wake_cv_;
+    bool interrupted_ = false;
+#endif
+};
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov)
+//
+// Every slot carries a sequence number that tells producers and consumers
+// whose turn it is, so each pushed item is popped by exactly one consumer.
+// `Capacity` must be a power of two.
+template <typename T, std::size_t Capacity>
+class MpmcQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0);
+
+public:
+    MpmcQueue() {
+        for (std::size_t i = 0; i < Capacity; ++i) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
 
-        annotate_pdf(cmd.pdf, cmd.outdir);
+    bool try_push(T value) {
+        std::size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots_[pos & (Capacity - 1)];
+            std::size_t seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
-        stop_flag.store(true);
-        worker.join();
+    std::optional<T> try_pop() {
+        std::size_t pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots_[pos & (Capacity - 1)];
+            std::size_t seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    T value = std::move(slot.value);
+                    slot.seq.store(pos + Capacity, std::memory_order_release);
+                    return value;
+                }
+            } else if (diff < 0) {
+                return std::nullopt; // empty
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<std::size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots_ = std::make_unique<Slot[]>(Capacity);
+    alignas(64) std::atomic<std::size_t> head_{0};
+    alignas(64) std::atomic<std::size_t> tail_{0};
+};
+
+// Set of crops some worker has taken responsibility for, with their content
+class ClaimSet {
+public:
+    // True for exactly one caller per path and content: a path claimed with
+    // another pixel `hash` (the box was edited) is claimed again. Hash 0 means
+    // unknown (a file found on disk) and only claims unclaimed paths.
+    // `changed` tells whether the path was claimed before with other content.
+    bool claim(const fs::path &path, std::uint64_t hash = 0, bool *changed = nullptr) {
+        std::lock_guard lock(mutex_);
+        auto [it, inserted] = claimed_.try_emplace(path.string(), hash);
+        if (changed) *changed = !inserted;
+        if (inserted) return true;
+        if (hash == 0 || it->second == hash) return false;
+        it->second = hash;
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::uint64_t> claimed_;
+};
+
+// A crop waiting for OCR
+struct OcrCrop {
+    fs::path path;      // the crop's file; its .tex goes next to it
+    cv::Mat pixels;     // empty until loaded for crops discovered on disk
+    std::uint64_t hash; // hash_pixels of `pixels`, 0 until known
+    MemoryLease lease;  // budget share of in-memory `pixels`, shared with the writer
+    bool changed;       // replaces other content at `path` (an edited box)
+};
+
+// One-shot cancellation flag that threads can sleep on
+class CancelToken {
+public:
+    // Returns false if already cancelled
+    bool cancel() {
+        {
+            std::lock_guard lock(mutex_);
+            if (cancelled_.exchange(true)) return false;
+        }
+        cv_.notify_all();
+        return true;
+    }
+
+    bool cancelled() const { return cancelled_.load(); }
+
+    // Sleep for `duration` unless cancelled first; returns false if cancelled
+    bool sleep_for(std::chrono::milliseconds duration) const {
+        std::unique_lock lock(mutex_);
+        return !cv_.wait_for(lock, duration, [&] { return cancelled_.load(); });
+    }
+
+private:
+    std::atomic_bool cancelled_{false};
+    mutable std::mutex mutex_;
+    mutable std::condition_variable cv_;
+};
+
+// OCR engine interface
+//
+// `recognize` gets a whole batch so real engines can amortise their per-call
+// cost, and must return one LaTeX string per crop in the same order. If
+// `cancel` fires it should return promptly with the results of the crops it
+// has finished, a prefix of the batch (possibly empty); those are kept and
+// the rest are retried next run. Several workers may call it concurrently.
+class OcrBackend {
+public:
+    virtual ~OcrBackend() = default;
+    // Engine and settings; results are only reused across runs for the same id
+    virtual std::string id() const = 0;
+    virtual std::vector<std::string> recognize(const std::vector<OcrCrop> &batch, const CancelToken &cancel) = 0;
+};
+
+// Stand-in engine that cycles through LATEX_SNIPPETS
+//
+// Latency model: a fixed cost per call, then a cost per crop after which that
+// crop's result is ready. Sleeps on the cancel token, so cancelling takes
+// effect immediately.
+class StubOcrBackend : public OcrBackend {
+public:
+    StubOcrBackend(std::chrono::milliseconds per_batch, std::chrono::milliseconds per_crop)
+        : per_batch_(per_batch), per_crop_(per_crop) {}
+
+    std::string id() const override { return "stub"; }
+
+    std::vector<std::string> recognize(const std::vector<OcrCrop> &batch, const CancelToken &cancel) override {
+        std::vector<std::string> latex;
+        if (!cancel.sleep_for(per_batch_)) return latex;
+        latex.reserve(batch.size());
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            if (!cancel.sleep_for(per_crop_)) break;
+            latex.push_back(next_latex_snippet());
+        }
+        return latex;
+    }
+
+private:
+    std::chrono::milliseconds per_batch_;
+    std::chrono::milliseconds per_crop_;
+};
+
+// LaTeX of crops OCR'd in earlier runs, shared by all decks
+//
+// Keyed by `key` (the crop's content hash and the backend's id), so a revised
+// deck only sends its changed regions to OCR. On disk it is a ResultsJournal
+// (append-only, checksummed lines) that is read into memory once at startup;
+// lookups never touch the file. An empty path disables the cache.
+class OcrResultCache {
+public:
+    explicit OcrResultCache(const fs::path &path) : enabled_(!path.empty()), journal_(path) {
+        if (!enabled_) return;
+        if (path.has_parent_path()) fs::create_directories(path.parent_path()); // none for a bare file name
+        for (auto &rec : journal_.load()) latex_[rec.hash] = std::move(rec.latex);
+    }
+
+    // Grayscale, tightly packed pixels plus the engine, so renderings that
+    // differ only in colour mode or row padding share an entry
+    static std::uint64_t key(const cv::Mat &pixels, const std::string &backend_id) {
+        cv::Mat gray;
+        if (pixels.channels() == 3) {
+            cv::cvtColor(pixels, gray, cv::COLOR_BGR2GRAY);
+        } else {
+            gray = pixels;
+        }
+        return fnv1a(backend_id.data(), backend_id.size(), hash_pixels(gray));
+    }
+
+    bool enabled() const { return enabled_; }
+
+    std::size_t size() const {
+        std::lock_guard lock(mutex_);
+        return latex_.size();
+    }
+
+    std::optional<std::string> find(std::uint64_t key) const {
+        std::lock_guard lock(mutex_);
+        auto it = latex_.find(key);
+        if (it == latex_.end()) return std::nullopt;
+        return it->second;
+    }
+
+    // `records` carry the cache key in `hash`
+    void insert(const std::vector<ResultsJournal::Record> &records) {
+        if (!enabled_ || records.empty()) return;
+        {
+            std::lock_guard lock(mutex_);
+            for (const auto &rec : records) latex_[rec.hash] = rec.latex;
+        }
+        journal_.append(records);
+    }
+
+private:
+    bool enabled_;
+    ResultsJournal journal_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::uint64_t, std::string> latex_;
+};
+
+// OCR worker pool
+//
+// Crops arrive in memory via `submit` and as files found by a discovery
+// thread (startup scan + CropWatcher); claiming each path first means no crop
+// is OCR'd twice, unless an edited box re-rendered it with new pixels. They
+// queue on a lock-free ring (spilling into a deque so `submit` never blocks)
+// and workers batch them, up to `max_batch` crops or `max_wait`, per backend
+// call. Crops already OCR'd by an earlier run come from the OcrResultCache;
+// near-duplicates (dHash within `dedup_distance` bits, similar aspect ratio)
+// reuse the LaTeX of the first such crop.
+//
+// Results are written atomically and recorded in the root folder's
+// ResultsJournal, which resuming claims up front; a folder with .tex files
+// but no journal has it seeded from those. `drain` finishes queued work up to
+// a deadline; `stop` cancels at once, keeping what the backend finished.
+class OcrPool {
+public:
+    static constexpr const char *JOURNAL_NAME = "ocr_journal.tsv";
+
+    OcrPool(const fs::path &folder, std::unique_ptr<OcrBackend> backend, const OcrOptions &opts)
+        : backend_(std::move(backend)), opts_(opts), folder_(folder), journal_(folder / JOURNAL_NAME),
+          cache_(opts.result_cache), backend_id_(backend_->id()), watcher_(folder),
+          dhash_index_(std::max(opts.dedup_distance, 0)) {
+        seed_journal();
+        std::vector<ResultsJournal::Record> done = journal_.load();
+        for (const auto &rec : done) claims_.claim(folder_ / rec.name, rec.hash); // the last record wins
+        std::cout << "[OCR] Journal: " << done.size() << " crops already done\n";
+        if (cache_.enabled()) std::cout << "[OCR] Result cache: " << cache_.size() << " entries\n";
+
+        discovery_ = std::thread(&OcrPool::discovery_loop, this);
+        for (int i = 0; i < std::max(opts_.workers, 1); ++i) {
+            workers_.emplace_back(&OcrPool::worker_loop, this, i);
+        }
+    }
+
+    ~OcrPool() { stop(); }
+
+    OcrPool(const OcrPool &) = delete;
+    OcrPool &operator=(const OcrPool &) = delete;
+
+    // Queue an in-memory crop; `path` is where its .tex goes (the image itself
+    // may or may not be written there). The pixels are shared, not copied;
+    // `lease` is released once they are OCR'd.
+    void submit(const fs::path &path, cv::Mat pixels, MemoryLease lease = {}) {
+        const std::uint64_t hash = hash_pixels(pixels);
+        bool changed = false;
+        if (claims_.claim(path, hash, &changed)) push({path, std::move(pixels), hash, std::move(lease), changed});
+    }
+
+    // Also pick up crops written to `dir` (a subfolder of the root folder)
+    void watch(const fs::path &dir) {
+        watcher_.add(dir);
+        enqueue(CropWatcher::scan(dir));
+    }
+
+    // Crops finished and crops queued so far, for progress reports
+    std::size_t done() const { return done_.load(); }
+    std::size_t total() const { return total_.load(); }
+
+    // Block until every crop queued so far has been processed, or `timeout`
+    // has passed; returns true once idle
+    bool wait_idle_for(std::chrono::milliseconds timeout) {
+        std::unique_lock lock(idle_mutex_);
+        return idle_cv_.wait_for(lock, timeout, [&] { return outstanding_ == 0; });
+    }
+
+    // Stop picking up new crop files, let the workers finish everything
+    // queued or in flight until `deadline`, then stop. Unfinished crops are
+    // not journaled, so the next run picks them up again.
+    void drain(std::chrono::steady_clock::time_point deadline) {
+        // Not joined here: discovery may be pushing a large scan through the
+        // full queue, and the deadline counts from now
+        discovering_ = false;
+        watcher_.interrupt();
+        std::ptrdiff_t left;
+        {
+            std::unique_lock lock(idle_mutex_);
+            idle_cv_.wait_until(lock, deadline, [&] { return outstanding_ == 0; });
+            left = outstanding_;
+        }
+        if (left > 0) std::cout << "[OCR] Drain deadline passed; " << left << " crops left for the next run\n";
+        stop();
+    }
+
+    // Cancel in-flight batches (keeping what the backend finished) and join
+    void stop() {
+        if (!stop_.cancel()) return;
+        items_.release(static_cast<std::ptrdiff_t>(workers_.size())); // wake every worker
+        stop_discovery();
+        for (auto &t : workers_) t.join();
+    }
+
+private:
+    using Queue = MpmcQueue<OcrCrop, OcrConfig::QUEUE_CAPACITY>;
+
+    // Never blocks (render threads call this): crops go onto the lock-free
+    // queue while `space_` has free slots and onto `overflow_` beyond that.
+    // In-memory crops there are bounded by the memory budget.
+    void push(OcrCrop crop) {
+        if (stop_.cancelled()) return;
+        ++total_;
+        update_outstanding(+1);
+        if (space_.try_acquire()) {
+            // A free slot is guaranteed, but a consumer may still be vacating it
+            while (!queue_.try_push(crop)) std::this_thread::yield();
+        } else {
+            std::lock_guard lock(overflow_mutex_);
+            overflow_.push_back(std::move(crop));
+        }
+        items_.release();
+    }
+
+    // Journal every crop that already has a .tex file, when there is no
+    // journal yet, instead of OCR'ing it again and overwriting the .tex
+    void seed_journal() {
+        if (fs::exists(folder_ / JOURNAL_NAME)) return;
+        std::vector<ResultsJournal::Record> records;
+        for (const auto &entry : fs::recursive_directory_iterator(folder_)) {
+            const fs::path &crop = entry.path();
+            if (!is_crop_file(crop)) continue;
+            fs::path tex_path = crop;
+            tex_path.replace_extension(".tex");
+            std::ifstream in(tex_path, std::ios::binary);
+            if (!in) continue;
+            std::string latex((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            while (!latex.empty() && (latex.back() == '\n' || latex.back() == '\r')) latex.pop_back();
+            cv::Mat pixels = cv::imread(crop.string(), cv::IMREAD_UNCHANGED);
+            if (pixels.empty()) continue; // unreadable; the workers report it
+            records.push_back({hash_pixels(pixels), 0.0, crop.lexically_relative(folder_).string(), std::move(latex)});
+        }
+        if (records.empty()) return;
+        journal_.append(records);
+        std::cout << "[OCR] Journal: seeded with " << records.size() << " existing .tex files\n";
+    }
+
+    void stop_discovery() {
+        std::lock_guard lock(discovery_mutex_);
+        if (!discovery_.joinable()) return;
+        discovering_ = false;
+        watcher_.interrupt();
+        discovery_.join();
+    }
+
+    void update_outstanding(std::ptrdiff_t delta) {
+        bool idle;
+        {
+            std::lock_guard lock(idle_mutex_);
+            outstanding_ += delta;
+            idle = outstanding_ == 0;
+            metrics().ocr_queue = outstanding_;
+        }
+        if (idle) idle_cv_.notify_all();
+    }
+
+    // Pop after acquiring a semaphore token. The token guarantees an item, but
+    // a producer that reserved an earlier slot may still be writing it.
+    std::optional<OcrCrop> pop() {
+        while (!stop_.cancelled()) {
+            if (std::optional<OcrCrop> crop = queue_.try_pop()) {
+                space_.release();
+                return crop;
+            }
+            {
+                std::lock_guard lock(overflow_mutex_);
+                if (!overflow_.empty()) {
+                    OcrCrop crop = std::move(overflow_.front());
+                    overflow_.pop_front();
+                    return crop;
+                }
+            }
+            std::this_thread::yield();
+        }
+        return std::nullopt;
+    }
+
+    // Stops early once discovery is stopped: whatever is left is found again next run
+    void enqueue(std::vector<fs::path> paths) {
+        for (auto &path : paths) {
+            if (!discovering_.load() || stop_.cancelled()) return;
+            if (claims_.claim(path)) push({std::move(path), {}, 0, {}, false});
+        }
+    }
+
+    void discovery_loop() {
+        enqueue(CropWatcher::scan(folder_));
+        while (discovering_.load()) {
+            enqueue(watcher_.wait()); // returns early once interrupted
+        }
+    }
+
+    void worker_loop(int id) {
+        std::cout << "[OCR] Worker " << id << " started\n";
+        std::vector<OcrCrop> batch;
+        while (true) {
+            items_.acquire();
+            if (stop_.cancelled()) break;
+            std::optional<OcrCrop> first = pop();
+            if (!first) break;
+            batch.push_back(std::move(*first));
+
+            const auto deadline = std::chrono::steady_clock::now() + opts_.max_wait;
+            while (static_cast<int>(batch.size()) < opts_.max_batch && items_.try_acquire_until(deadline)) {
+                std::optional<OcrCrop> next = pop();
+                if (!next) break;
+                batch.push_back(std::move(*next));
+            }
+            const std::size_t taken = batch.size(); // `process` drops unreadable crops
+            process(batch);
+            done_ += taken;
+            update_outstanding(-static_cast<std::ptrdiff_t>(taken));
+            batch.clear();
+        }
+        std::cout << "[OCR] Worker " << id << " shutting down\n";
+    }
+
+    // First crop seen of a group of near-duplicates
+    struct Original {
+        std::uint64_t dhash;
+        double aspect;
+        std::optional<std::string> latex; // unset while being OCR'd
+        std::vector<OcrCrop> duplicates;  // to be written when `latex` arrives
+    };
+
+    // Caller holds `dedup_mutex_`; the earliest match wins
+    Original *find_original(std::uint64_t hash, double aspect) {
+        for (std::size_t id : dhash_index_.find(hash)) {
+            Original &o = originals_[id];
+            if (std::abs(o.aspect - aspect) <= OcrConfig::DEDUP_ASPECT * o.aspect) return &o;
+        }
+        return nullptr;
+    }
+
+    // Caller holds `dedup_mutex_`; returns the index into `originals_`
+    std::size_t add_original(Original o) {
+        const std::uint64_t hash = o.dhash;
+        originals_.push_back(std::move(o));
+        dhash_index_.insert(hash, originals_.size() - 1);
+        return originals_.size() - 1;
+    }
+
+    void process(std::vector<OcrCrop> &batch) {
+        // A crop file that cannot be decoded is not journaled, so the next run
+        // tries it again; the backend only ever gets pixels
+        std::erase_if(batch, [](OcrCrop &crop) {
+            if (crop.pixels.empty()) crop.pixels = cv::imread(crop.path.string(), cv::IMREAD_UNCHANGED);
+            if (!crop.pixels.empty()) return false;
+            std::cerr << "[OCR] Cannot read " << crop.path.filename().string() << ", left for the next run\n";
+            return true;
+        });
+
+        const bool dedup = opts_.dedup_distance >= 0;
+        std::vector<std::uint64_t> hashes(batch.size());
+        std::vector<std::uint64_t> keys(batch.size());
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            const OcrCrop &crop = batch[i];
+            if (dedup) hashes[i] = dhash(crop.pixels);
+            if (cache_.enabled()) keys[i] = OcrResultCache::key(crop.pixels, backend_id_);
+        }
+
+        // Split off crops with a known result (from an earlier run or an
+        // earlier duplicate), which are written right away, and duplicates of
+        // in-flight crops, which go to their original; the rest are new
+        // originals for the backend
+        std::vector<OcrCrop> unique;
+        std::vector<std::size_t> unique_ids; // index into originals_
+        std::vector<std::uint64_t> unique_keys;
+        std::vector<std::pair<OcrCrop, std::string>> resolved;
+        {
+            std::lock_guard lock(dedup_mutex_);
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                OcrCrop &crop = batch[i];
+                const double aspect = static_cast<double>(crop.pixels.cols) / crop.pixels.rows;
+                std::optional<std::string> cached;
+                if (cache_.enabled()) cached = cache_.find(keys[i]);
+                if (cached) {
+                    std::cout << "[OCR] Cached " << crop.path.filename().string() << "\n";
+                    ++metrics().ocr_cached;
+                    if (dedup) add_original({hashes[i], aspect, cached, {}});
+                    resolved.emplace_back(std::move(crop), std::move(*cached));
+                    continue;
+                }
+                if (!dedup) {
+                    unique.push_back(std::move(crop));
+                    unique_ids.push_back(SIZE_MAX);
+                    unique_keys.push_back(keys[i]);
+                    continue;
+                }
+                // An edited crop resembles its own earlier version, whose
+                // LaTeX is exactly what must not be reused
+                const std::uint64_t hash = hashes[i];
+                if (Original *o = crop.changed ? nullptr : find_original(hash, aspect)) {
+                    std::cout << "[OCR] Duplicate " << crop.path.filename().string() << "\n";
+                    ++metrics().ocr_duplicates;
+                    if (o->latex) {
+                        resolved.emplace_back(std::move(crop), *o->latex);
+                    } else {
+                        o->duplicates.push_back(std::move(crop));
+                    }
+                    continue;
+                }
+                unique_ids.push_back(add_original({hash, aspect, std::nullopt, {}}));
+                unique_keys.push_back(keys[i]);
+                unique.push_back(std::move(crop));
+            }
+        }
+        for (const auto &crop : unique) std::cout << "[OCR] Processing " << crop.path.filename().string() << "\n";
+
+        std::vector<std::string> latex;
+        double ms_per_crop = 0.0;
+        if (!unique.empty()) {
+            const auto start = std::chrono::steady_clock::now();
+            latex = backend_->recognize(unique, stop_);
+            if (latex.size() < unique.size()) { // cancelled: keep what was finished
+                std::cout << "[OCR] Cancelled with " << unique.size() - latex.size() << " crops unfinished\n";
+                unique.resize(latex.size());
+                unique_ids.resize(latex.size());
+                unique_keys.resize(latex.size());
+            }
+            // `resolved` is written below even if the backend finished nothing
+            if (!unique.empty()) {
+                const double seconds =
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                metrics().ocr_batch.observe(seconds);
+                metrics().ocr_recognized += unique.size();
+                ms_per_crop = seconds * 1e3 / static_cast<double>(unique.size());
+            }
+        }
+
+        {
+            std::lock_guard lock(dedup_mutex_);
+            for (std::size_t i = 0; i < unique.size(); ++i) {
+                if (unique_ids[i] == SIZE_MAX) continue;
+                Original &o = originals_[unique_ids[i]];
+                o.latex = latex[i];
+                for (auto &dup : o.duplicates) resolved.emplace_back(std::move(dup), latex[i]);
+                o.duplicates.clear();
+            }
+        }
+        if (cache_.enabled()) {
+            std::vector<ResultsJournal::Record> entries;
+            for (std::size_t i = 0; i < unique.size(); ++i) {
+                entries.push_back({unique_keys[i], ms_per_crop, unique[i].path.filename().string(), latex[i]});
+            }
+            try {
+                cache_.insert(entries);
+            } catch (const std::exception &ex) {
+                std::cerr << "[OCR] " << ex.what() << "\n";
+            }
+        }
+
+        std::vector<ResultsJournal::Record> records;
+        auto finish = [&](OcrCrop &crop, std::string &text, double ms) {
+            fs::path tex_path = crop.path;
+            tex_path.replace_extension(".tex");
+            if (!write_file_atomic(tex_path, text + '\n')) {
+                std::cerr << "[OCR] Failed to write " << tex_path << "\n";
+                return; // not journaled, so retried next run
+            }
+            std::cout << "[OCR]   -> wrote " << tex_path.filename().string() << " '" << text << "'\n";
+            const std::uint64_t hash = crop.hash ? crop.hash : hash_pixels(crop.pixels);
+            records.push_back({hash, ms, crop.path.lexically_relative(folder_).string(), std::move(text)});
+        };
+        for (std::size_t i = 0; i < unique.size(); ++i) finish(unique[i], latex[i], ms_per_crop);
+        for (auto &[crop, text] : resolved) finish(crop, text, 0.0);
+        try {
+            journal_.append(records);
+        } catch (const std::exception &ex) {
+            std::cerr << "[OCR] " << ex.what() << "\n";
+        }
+    }
+
+    std::unique_ptr<OcrBackend> backend_;
+    OcrOptions opts_;
+    fs::path folder_;
+    ResultsJournal journal_;
+    OcrResultCache cache_;
+    std::string backend_id_;
+    CropWatcher watcher_;
+    ClaimSet claims_;
+    Queue queue_;
+    std::counting_semaphore<> items_{0};
+    std::counting_semaphore<> space_{static_cast<std::ptrdiff_t>(OcrConfig::QUEUE_CAPACITY)};
+    std::mutex overflow_mutex_;
+    std::deque<OcrCrop> overflow_; // queued beyond QUEUE_CAPACITY
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    std::ptrdiff_t outstanding_ = 0; // queued or being processed
+    std::mutex dedup_mutex_;
+    std::deque<Original> originals_; // stable addresses; indices stay valid
+    DhashIndex dhash_index_;         // of originals_, by index
+    std::atomic<std::size_t> done_{0};
+    std::atomic<std::size_t> total_{0};
+    CancelToken stop_;
+    std::atomic_bool discovering_{true};
+    std::mutex discovery_mutex_;
+    std::thread discovery_;
+    std::vector<std::thread> workers_;
+};
+
+// Byte-bounded least-recently-used cache
+//
+// Not synchronised; owners guard it with their own mutex. Entries larger than
+// the whole budget are not cached at all.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache {
+public:
+    // Entries also count against `kind`'s slice of `shared`, if given, across
+    // all caches using it
+    explicit LruCache(std::size_t budget_bytes, MemoryBudget *shared = nullptr,
+        MemoryBudget::Cache kind = MemoryBudget::Cache::Slides)
+        : budget_(budget_bytes), shared_(shared), kind_(kind) {}
+
+    ~LruCache() { clear(); }
+
+    LruCache(const LruCache &) = delete;
+    LruCache &operator=(const LruCache &) = delete;
+
+    std::optional<Value> get(const Key &key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) return std::nullopt;
+        entries_.splice(entries_.begin(), entries_, it->second); // mark most recent
+        return it->second->value;
+    }
+
+    // Returns false if `value` was not cached
+    bool put(const Key &key, Value value, std::size_t bytes) {
+        erase(key);
+        if (bytes > budget_) return false;
+        while (used_ + bytes > budget_) evict();
+        // Other caches may hold the shared slice: make room from this one's
+        // entries, and leave `value` uncached if that is not enough
+        while (shared_ && !shared_->try_cache(bytes, kind_)) {
+            if (entries_.empty()) return false;
+            evict();
+        }
+        entries_.push_front({key, std::move(value), bytes});
+        index_.emplace(key, entries_.begin());
+        used_ += bytes;
+        return true;
+    }
+
+    void erase(const Key &key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) return;
+        used_ -= it->second->bytes;
+        if (shared_) shared_->uncache(it->second->bytes, kind_);
+        entries_.erase(it->second);
+        index_.erase(it);
+    }
+
+    void clear() {
+        if (shared_) shared_->uncache(used_, kind_);
+        entries_.clear();
+        index_.clear();
+        used_ = 0;
+    }
+
+private:
+    struct Entry {
+        Key key;
+        Value value;
+        std::size_t bytes;
+    };
+
+    void evict() {
+        used_ -= entries_.back().bytes;
+        if (shared_) shared_->uncache(entries_.back().bytes, kind_);
+        index_.erase(entries_.back().key);
+        entries_.pop_back();
+    }
+
+    std::size_t budget_;
+    MemoryBudget *shared_;
+    MemoryBudget::Cache kind_;
+    std::size_t used_ = 0;
+    std::list<Entry> entries_; // front = most recently used
+    std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> index_;
+};
+
+// Cache key of a rendered slide
+struct SlideKey {
+    int page;
+    int dpi;
+    Colorspace colorspace;
+
+    bool operator==(const SlideKey &) const = default;
+};
+
+struct SlideKeyHash {
+    std::size_t operator()(const SlideKey &k) const {
+        return std::hash<int>{}(k.page) ^ (std::hash<int>{}(k.dpi) << 1) ^
+               (std::hash<int>{}(static_cast<int>(k.colorspace)) << 2);
+    }
+};
+
+// Cache key of one square of a slide rendered for the zoomed viewer
+struct TileKey {
+    int page;
+    double scale; // pixels per PDF point
+    int tx, ty;   // column and row in RenderConfig::TILE_SIZE steps
+
+    bool operator==(const TileKey &) const = default;
+};
+
+struct TileKeyHash {
+    std::size_t operator()(const TileKey &k) const {
+        return std::hash<int>{}(k.page) ^ (std::hash<double>{}(k.scale) << 1) ^ (std::hash<int>{}(k.tx) << 2) ^
+               (std::hash<int>{}(k.ty) << 3);
+    }
+};
+
+static std::size_t mat_bytes(const cv::Mat &m) { return m.total() * m.elemSize(); }
+
+// Rendered image plus whatever keeps its pixels alive (e.g. a file mapping)
+struct Raster {
+    cv::Mat img;
+    std::shared_ptr<const void> owner;
+};
+
+// A rendered slide: full-resolution raster for crops plus a screen-sized copy for the viewer
+struct Slide {
+    Raster full;
+    cv::Mat display;
+    double display_scale = 1.0;      // display px per full-resolution px
+    std::vector<cv::Rect> proposals; // candidate boxes, full-resolution px
+
+    std::size_t bytes() const {
+        return mat_bytes(full.img) + (display.data == full.img.data ? 0 : mat_bytes(display));
+    }
+};
+
+// Downscale (never upscale) `full` once so that it fits into `max`
+static Slide make_slide(Raster full, cv::Size max) {
+    Slide slide{std::move(full), {}, 1.0, {}};
+    const cv::Mat &img = slide.full.img;
+    slide.display_scale = std::min({1.0, static_cast<double>(max.width) / img.cols,
+        static_cast<double>(max.height) / img.rows});
+    if (slide.display_scale < 1.0) {
+        cv::resize(img, slide.display, cv::Size(), slide.display_scale, slide.display_scale, cv::INTER_AREA);
+    } else {
+        slide.display = img;
+    }
+    return slide;
+}
+
+// Read-only view of a whole file, unmapped on destruction
+class MappedFile {
+public:
+    explicit MappedFile(const fs::path &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st{};
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            size_ = static_cast<std::size_t>(st.st_size);
+            // Private + writable: stray writes to the Mat stay in memory instead of faulting
+            void *p = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            data_ = p == MAP_FAILED ? nullptr : static_cast<unsigned char *>(p);
+        }
+        ::close(fd);
+    }
+    ~MappedFile() {
+        if (data_) ::munmap(data_, size_);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    unsigned char *data() const { return data_; }
+    std::size_t size() const { return data_ ? size_ : 0; }
+
+private:
+    unsigned char *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// On-disk cache of raw rendered slides
+//
+// One file per (PDF content hash, page, dpi, colorspace): a 64-byte header
+// followed by the tightly packed pixel rows, so a hit is a single mmap with no
+// decoding. Files are written to a temporary name and renamed into place, so
+// a crash never leaves a truncated entry behind.
+//
+// The directory is shared by all decks and runs and kept under `max_bytes`:
+// whenever it grows past that, the least recently used entries (hits touch
+// their file's mtime) are deleted until it is back under PRUNE_TO of it.
+class DiskRenderCache {
+public:
+    // An empty `dir` disables the cache
+    DiskRenderCache(const fs::path &dir, std::uint64_t pdf_hash, std::uintmax_t max_bytes)
+        : dir_(dir), pdf_hash_(pdf_hash), max_bytes_(max_bytes) {
+        if (dir_.empty()) return;
+        fs::create_directories(dir_);
+        prune();
+    }
+
+    std::optional<Raster> load(const SlideKey &key) const {
+        if (dir_.empty()) return std::nullopt;
+        const fs::path file_path = path(key);
+        auto file = std::make_shared<MappedFile>(file_path);
+        if (file->size() < sizeof(Header)) return std::nullopt;
+
+        Header hdr;
+        std::memcpy(&hdr, file->data(), sizeof(hdr));
+        if (std::memcmp(hdr.magic, MAGIC, sizeof(hdr.magic)) != 0) return std::nullopt;
+        // Never trust the header: a corrupt entry must not build a Mat over
+        // memory past the mapping
+        if (hdr.type != CV_8UC1 && hdr.type != CV_8UC3) return std::nullopt;
+        constexpr std::uint32_t max_dim = std::numeric_limits<int>::max();
+        if (hdr.rows == 0 || hdr.cols == 0 || hdr.rows > max_dim || hdr.cols > max_dim) return std::nullopt;
+        const std::uint64_t pixel_bytes = std::uint64_t{hdr.rows} * hdr.cols * (hdr.type == CV_8UC3 ? 3 : 1);
+        if (file->size() != sizeof(Header) + pixel_bytes) return std::nullopt;
+        cv::Mat img(static_cast<int>(hdr.rows), static_cast<int>(hdr.cols), hdr.type,
+            file->data() + sizeof(Header));
+        std::error_code ec;
+        fs::last_write_time(file_path, fs::file_time_type::clock::now(), ec); // recently used
+        return Raster{img, std::move(file)};
+    }
+
+    void store(const SlideKey &key, const cv::Mat &img) {
+        if (dir_.empty()) return;
+        Header hdr{};
+        std::memcpy(hdr.magic, MAGIC, sizeof(hdr.magic));
+        hdr.rows = static_cast<std::uint32_t>(img.rows);
+        hdr.cols = static_cast<std::uint32_t>(img.cols);
+        hdr.type = img.type();
+
+        fs::path final_path = path(key);
+        fs::path tmp_path = final_path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+            const std::size_t row_bytes = img.cols * img.elemSize();
+            for (int r = 0; r < img.rows; ++r) {
+                out.write(reinterpret_cast<const char *>(img.ptr(r)), static_cast<std::streamsize>(row_bytes));
+            }
+            if (!out) {
+                std::error_code ec;
+                fs::remove(tmp_path, ec);
+                return; // caching is best-effort
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp_path, final_path, ec);
+        if (ec) return;
+
+        std::lock_guard lock(prune_mutex_);
+        used_ += sizeof(Header) + mat_bytes(img);
+        if (used_ > max_bytes_) prune();
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'X', 'R', 'A', 'S', 'T', '0', '0', '1'};
+    static constexpr double PRUNE_TO = 0.9; // of max_bytes, so pruning is not needed on every store
+    static constexpr auto STALE_TMP_AGE = std::chrono::hours(1); // older *.tmp files are crash leftovers
+
+    // Delete the least recently used entries of every deck until the
+    // directory fits, and temporaries left behind by a crashed store;
+    // best-effort, as other processes may prune it too. Caller holds
+    // `prune_mutex_` (or is the constructor).
+    void prune() {
+        struct Entry {
+            fs::file_time_type time;
+            std::uintmax_t size;
+            fs::path path;
+        };
+        std::vector<Entry> entries;
+        std::uintmax_t total = 0;
+        std::error_code ec;
+        const fs::file_time_type stale_before = fs::file_time_type::clock::now() - STALE_TMP_AGE;
+        for (fs::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path ext = it->path().extension();
+            if (ext != ".raw" && ext != ".tmp") continue;
+            std::error_code entry_ec;
+            const std::uintmax_t size = it->file_size(entry_ec);
+            const fs::file_time_type time = it->last_write_time(entry_ec);
+            if (entry_ec) continue; // pruned or replaced meanwhile
+            if (ext == ".tmp") {
+                if (time < stale_before) fs::remove(it->path(), entry_ec); // younger ones may be mid-store
+                continue;
+            }
+            entries.push_back({time, size, it->path()});
+            total += size;
+        }
+        if (total > max_bytes_) {
+            std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time < b.time; });
+            const auto target = static_cast<std::uintmax_t>(max_bytes_ * PRUNE_TO);
+            for (const Entry &e : entries) {
+                if (total <= target) break;
+                if (fs::remove(e.path, ec)) total -= e.size;
+            }
+        }
+        used_ = total;
+    }
+
+    struct Header {
+        char magic[8];
+        std::uint32_t rows;
+        std::uint32_t cols;
+        std::int32_t type;
+        std::uint8_t reserved[44];
+    };
+    static_assert(sizeof(Header) == 64);
+
+    fs::path path(const SlideKey &key) const {
+        char name[96];
+        std::snprintf(name, sizeof(name), "%016llx_p%04d_%ddpi_%s.raw",
+            static_cast<unsigned long long>(pdf_hash_), key.page + 1, key.dpi,
+            key.colorspace == Colorspace::Gray ? "gray" : "bgr");
+        return dir_ / name;
+    }
+
+    fs::path dir_;
+    std::uint64_t pdf_hash_;
+    std::uintmax_t max_bytes_;
+    std::mutex prune_mutex_;
+    std::uintmax_t used_ = 0; // directory size as of the last prune, plus our stores since
+};
+
+// Candidate formula/text regions on a rendered slide, in `img` pixels
+//
+// Ink is separated from the background with Otsu's threshold (inverted for
+// light-on-dark slides), a wide closing merges glyphs into words and lines,
+// and every connected component of plausible size becomes a candidate, as do
+// `hints` (e.g. text-layer blocks). Candidates that lie mostly inside a bigger
+// one are dropped, and the rest are returned in reading order. On a
+// display-sized slide this takes a few milliseconds.
+static std::vector<cv::Rect> propose_regions(const cv::Mat &img, const std::vector<cv::Rect> &hints) {
+    cv::Mat gray;
+    if (img.channels() == 1) {
+        gray = img;
+    } else {
+        cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+    }
+    cv::Mat ink;
+    cv::threshold(gray, ink, 0, 255, cv::THRESH_BINARY_INV | cv::THRESH_OTSU);
+    if (static_cast<std::size_t>(cv::countNonZero(ink)) > ink.total() / 2) cv::bitwise_not(ink, ink);
+    cv::morphologyEx(ink, ink, cv::MORPH_CLOSE,
+        cv::getStructuringElement(cv::MORPH_RECT, {ProposalConfig::CLOSE_W, ProposalConfig::CLOSE_H}));
+
+    cv::Mat labels, stats, centroids;
+    const int n = cv::connectedComponentsWithStats(ink, labels, stats, centroids, 8, CV_32S);
+    const cv::Rect page(0, 0, img.cols, img.rows);
+    std::vector<cv::Rect> found = hints;
+    for (int i = 1; i < n; ++i) { // label 0 is the background
+        cv::Rect r(stats.at<int>(i, cv::CC_STAT_LEFT), stats.at<int>(i, cv::CC_STAT_TOP),
+            stats.at<int>(i, cv::CC_STAT_WIDTH), stats.at<int>(i, cv::CC_STAT_HEIGHT));
+        if (r.width < ProposalConfig::MIN_W || r.height < ProposalConfig::MIN_H) continue;
+        if (r.area() > ProposalConfig::MAX_PAGE_FRACTION * page.area()) continue; // frames, backgrounds
+        found.push_back(r);
+    }
+    for (cv::Rect &r : found) {
+        r = cv::Rect(r.x - ProposalConfig::PAD, r.y - ProposalConfig::PAD, r.width + 2 * ProposalConfig::PAD,
+                r.height + 2 * ProposalConfig::PAD) & page;
+    }
+
+    std::sort(found.begin(), found.end(), [](const cv::Rect &a, const cv::Rect &b) { return a.area() > b.area(); });
+    std::vector<cv::Rect> kept;
+    for (const cv::Rect &r : found) {
+        if (r.empty()) continue;
+        bool inside = std::any_of(kept.begin(), kept.end(),
+            [&](const cv::Rect &k) { return (r & k).area() >= ProposalConfig::CONTAINED * r.area(); });
+        if (!inside) kept.push_back(r);
+    }
+    std::sort(kept.begin(), kept.end(),
+        [](const cv::Rect &a, const cv::Rect &b) { return a.y != b.y ? a.y < b.y : a.x < b.x; });
+    return kept;
+}
+
+// Play `list` through transform `ctm` and rasterise the device-space `area`
+//
+// The pixmap is created over the Mat's own buffer (3-channel BGR or 1-channel
+// gray, rows tightly packed), so the result needs no copy or colour conversion
+// and lives exactly as long as the Mat. Display lists may be played from any
+// thread with its own cloned context.
+static cv::Mat rasterize(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_irect area, Colorspace colorspace) {
+    const bool gray = colorspace == Colorspace::Gray;
+    cv::Mat img(area.y1 - area.y0, area.x1 - area.x0, gray ? CV_8UC1 : CV_8UC3);
+
+    fz_pixmap *pix = nullptr;
+    fz_device *dev = nullptr;
+    bool failed = false;
+    fz_var(pix);
+    fz_var(dev);
+    fz_try(ctx) {
+        fz_colorspace *cs = gray ? fz_device_gray(ctx) : fz_device_bgr(ctx);
+        pix = fz_new_pixmap_with_bbox_and_data(ctx, cs, area, nullptr, 0, img.data);
+        fz_clear_pixmap_with_value(ctx, pix, 0xff);
+        dev = fz_new_draw_device(ctx, fz_identity, pix);
+        fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(area), nullptr);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, dev);
+        fz_drop_pixmap(ctx, pix); // does not free caller-provided samples
+    }
+    fz_catch(ctx) {
+        failed = true;
+    }
+    if (failed) throw std::runtime_error(std::string("MuPDF render failed: ") + fz_caught_message(ctx));
+    return img;
+}
+
+// Shared MuPDF render threads
+//
+// Owns the base context, which has locking callbacks installed, and one
+// context cloned from it per thread. Tasks are run in FIFO order and get the
+// running thread's context. All open decks (one SlideRenderer each) share a
+// single pool, so a batch run keeps every core busy without oversubscribing.
+class RenderPool {
+public:
+    explicit RenderPool(int threads) {
+        fz_locks_context locks{this, &RenderPool::lock, &RenderPool::unlock};
+        ctx_ = fz_new_context(nullptr, &locks, FZ_STORE_DEFAULT);
+        if (!ctx_) throw std::runtime_error("Cannot create MuPDF context");
+
+        bool failed = false;
+        fz_try(ctx_) {
+            fz_register_document_handlers(ctx_);
+        }
+        fz_catch(ctx_) {
+            failed = true;
+        }
+        if (failed) {
+            std::string msg = fz_caught_message(ctx_);
+            fz_drop_context(ctx_);
+            throw std::runtime_error("Cannot register document handlers: " + msg);
+        }
+        for (int i = 0; i < std::max(threads, 1); ++i) {
+            fz_context *thread_ctx = clone();
+            if (!thread_ctx) break;
+            threads_.emplace_back(&RenderPool::worker_loop, this, thread_ctx);
+        }
+        if (threads_.empty()) {
+            fz_drop_context(ctx_);
+            throw std::runtime_error("Cannot clone MuPDF context");
+        }
+    }
+
+    // Runs every task still queued before joining
+    ~RenderPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : threads_) t.join();
+        fz_drop_context(ctx_);
+    }
+
+    RenderPool(const RenderPool &) = delete;
+    RenderPool &operator=(const RenderPool &) = delete;
+
+    // New context sharing the pool's locks and resource store; the caller drops it
+    fz_context *clone() {
+        std::lock_guard lock(clone_mutex_);
+        return fz_clone_context(ctx_);
+    }
+
+    void post(std::function<void(fz_context *)> task) {
+        {
+            std::lock_guard lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        ++metrics().render_queue;
+        cv_.notify_one();
+    }
+
+private:
+    static void lock(void *user, int lock) { static_cast<RenderPool *>(user)->fz_locks_[lock].lock(); }
+    static void unlock(void *user, int lock) { static_cast<RenderPool *>(user)->fz_locks_[lock].unlock(); }
+
+    void worker_loop(fz_context *ctx) {
+        while (true) {
+            std::function<void(fz_context *)> task;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [&] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) break; // stopping and drained
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            --metrics().render_queue;
+            task(ctx);
+        }
+        fz_drop_context(ctx);
+    }
+
+    std::mutex fz_locks_[FZ_LOCK_MAX]; // MuPDF's global locks, shared by all contexts
+    fz_context *ctx_ = nullptr;        // base context; threads and documents use clones
+    std::mutex clone_mutex_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void(fz_context *)>> tasks_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// Background slide renderer for one deck
+//
+// Rendering runs on a shared RenderPool. The document is opened with its own
+// cloned context and shared by the pool threads: page loading and
+// display-list recording touch it and are serialised on `doc_mutex_`, while
+// rasterising the display lists (the expensive part, including image
+// decoding) runs in parallel. Each page is recorded once into a display list
+// kept in a small LRU, so the slide, its crops and its text layer replay one
+// recording instead of re-interpreting the content stream each time.
+//
+// Jobs wait in the renderer's own queues and every queued job posts one task
+// to the pool, which runs whichever of this deck's jobs is most urgent at
+// that moment, so priorities hold even though the pool itself is FIFO.
+//
+// `get` returns the requested slide (rendering it with priority if it is not
+// ready yet) and queues its neighbours, so that turning the page usually finds
+// the next slide already rasterised. Finished slides go
+// into an LRU cache, which makes going back to a recent slide free, and into
+// the on-disk cache, which makes reopening the same deck cheap. The viewer's
+// downscaled copy and, if enabled, the box proposals are produced here too,
+// off the GUI thread.
+//
+// Crops are not cut from the slide raster: `render_crop` re-renders just the
+// box's region from the PDF at `crop_dpi`. Crop jobs run after the slide the
+// user is waiting for but before prefetches. `finish_crops` waits for them
+// (up to a deadline, if given); destruction drops any still queued.
+// A crop is only rendered once the memory budget has room for it; until then
+// it stays queued here, prefetches may overtake it, and the pool threads stay
+// free for slides and tiles. A released lease posts the stalled tasks again.
+// Zoomed-viewer tiles (`tiles`) go between the two: they are what the user is
+// looking at, but unlike crops they are dropped once the view moves away.
+class SlideRenderer {
+public:
+    SlideRenderer(RenderPool &pool, const fs::path &pdf_path, const RenderOptions &opts)
+        : pool_(pool), opts_(opts), tile_cache_(opts.tile_cache_bytes, &memory_budget(), MemoryBudget::Cache::Tiles),
+          cache_(opts.cache_bytes, &memory_budget()),
+          disk_cache_(opts.disk_cache_dir, opts.disk_cache_dir.empty() ? 0 : hash_file(pdf_path),
+              opts.disk_cache_bytes) {
+        ctx_ = pool_.clone();
+        if (!ctx_) throw std::runtime_error("Cannot clone MuPDF context");
+
+        bool failed = false;
+        fz_try(ctx_) {
+            doc_ = fz_open_document(ctx_, pdf_path.string().c_str());
+            page_count_ = fz_count_pages(ctx_, doc_);
+        }
+        fz_catch(ctx_) {
+            failed = true;
+        }
+        if (failed) {
+            std::string msg = fz_caught_message(ctx_);
+            if (doc_) fz_drop_document(ctx_, doc_);
+            fz_drop_context(ctx_);
+            throw std::runtime_error("Cannot open " + pdf_path.string() + ": " + msg);
+        }
+        if (page_count_ <= 0) {
+            fz_drop_document(ctx_, doc_);
+            fz_drop_context(ctx_);
+            throw std::runtime_error("PDF contains no pages: " + pdf_path.string());
+        }
+        listener_ = memory_budget().subscribe([this] { retry_crops(); });
+    }
+
+    // Drops queued slides, tiles and crops (call `finish_crops` first to keep
+    // the crops), then waits until no pool task refers to this renderer any more
+    ~SlideRenderer() {
+        {
+            std::unique_lock lock(mutex_);
+            queue_.clear();
+            tiles_.clear();
+            crops_.clear();
+            idle_cv_.wait(lock, [&] { return tasks_ == 0; });
+        }
+        memory_budget().unsubscribe(listener_);
+        lists_.clear(); // drops the display lists, which reference the document
+        fz_drop_document(ctx_, doc_);
+        fz_drop_context(ctx_);
+    }
+
+    SlideRenderer(const SlideRenderer &) = delete;
+    SlideRenderer &operator=(const SlideRenderer &) = delete;
+
+    int page_count() const { return page_count_; }
+
+    // Done viewing: drop queued prefetches and tiles, and the cached slides and
+    // tiles, so their memory goes to the next deck. Queued crops keep rendering.
+    void close() {
+        std::lock_guard lock(mutex_);
+        queue_.clear();
+        tiles_.clear();
+        tiles_pending_.clear();
+        cache_.clear();
+        tile_cache_.clear();
+    }
+
+    // Block until every queued crop has been rendered (or started)
+    void finish_crops() {
+        std::unique_lock lock(mutex_);
+        idle_cv_.wait(lock, [&] { return crops_.empty(); });
+    }
+
+    // Like `finish_crops`, but drops the crops still queued at `deadline`
+    // (waiting for memory behind slow OCR) and returns how many
+    std::size_t finish_crops(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock lock(mutex_);
+        idle_cv_.wait_until(lock, deadline, [&] { return crops_.empty(); });
+        const std::size_t dropped = crops_.size();
+        crops_.clear();
+        return dropped;
+    }
+
+    // Blocks until slide `page` is rendered and prefetches the slides around it
+    Slide get(int page) {
+        std::shared_future<Slide> slide;
+        {
+            std::lock_guard lock(mutex_);
+            // Drop queued prefetches that moved out of the window
+            std::erase_if(queue_, [&](const Job &job) {
+                bool stale = std::abs(job.key.page - page) > RenderConfig::PREFETCH_RADIUS;
+                if (stale) pending_.erase(job.key.page);
+                return stale;
+            });
+            if (auto cached = cache_.get(key(page))) {
+                slide = make_ready(std::move(*cached));
+            } else {
+                slide = request(page, true);
+            }
+            for (int d = 1; d <= RenderConfig::PREFETCH_RADIUS; ++d) {
+                request(page + d, false);
+                request(page - d, false);
+            }
+        }
+        return slide.get();
+    }
+
+    // Tiles for the zoomed viewer, in the order of `wanted`; tiles that are not
+    // rendered yet come back empty and are queued ahead of crops and
+    // prefetches. Queued tiles that are no longer wanted (the view moved on)
+    // are dropped. `tile_generation` changes whenever a tile finishes.
+    std::vector<cv::Mat> tiles(const std::vector<TileKey> &wanted) {
+        std::vector<cv::Mat> found(wanted.size());
+        std::lock_guard lock(mutex_);
+        std::erase_if(tiles_, [&](const TileKey &key) {
+            bool stale = std::find(wanted.begin(), wanted.end(), key) == wanted.end();
+            if (stale) tiles_pending_.erase(key);
+            return stale;
+        });
+        for (std::size_t i = 0; i < wanted.size(); ++i) {
+            if (auto cached = tile_cache_.get(wanted[i])) {
+                found[i] = *cached;
+            } else if (tiles_pending_.insert(wanted[i]).second) {
+                tiles_.push_back(wanted[i]);
+                post_task();
+            }
+        }
+        return found;
+    }
+
+    std::uint64_t tile_generation() const { return tile_generation_.load(); }
+
+    // Re-render `box` (PDF points from the page's top-left corner) of slide `page`
+    // at the crop DPI on a render thread and hand the result to `done`, also on
+    // that render thread. The crop's bytes are reserved in the memory budget
+    // first (waiting there if queued crops fill their share); `done` gets the
+    // lease to pass on to whatever holds the crop.
+    void render_crop(int page, fz_rect box, std::function<void(cv::Mat, MemoryLease)> done) {
+        std::lock_guard lock(mutex_);
+        crops_.push_back({page, box, std::move(done)});
+        post_task();
+    }
+
+private:
+    struct Job {
+        SlideKey key;
+        std::promise<Slide> promise;
+        bool urgent = false;
+    };
+
+    struct CropJob {
+        int page;
+        fz_rect box;
+        std::function<void(cv::Mat, MemoryLease)> done;
+    };
+
+    SlideKey key(int page) const {
+        return {page, static_cast<int>(RenderConfig::DPI), opts_.colorspace};
+    }
+
+    static std::shared_future<Slide> make_ready(Slide slide) {
+        std::promise<Slide> p;
+        p.set_value(std::move(slide));
+        return p.get_future().share();
+    }
+
+    // Caller holds `mutex_`. Returns an invalid future for cached or out-of-range pages.
+    std::shared_future<Slide> request(int page, bool urgent) {
+        if (page < 0 || page >= page_count_) return {};
+        if (auto it = pending_.find(page); it != pending_.end()) {
+            if (urgent) {
+                // Still queued behind prefetches? Move it to the front.
+                auto job = std::find_if(queue_.begin(), queue_.end(),
+                    [&](const Job &j) { return j.key.page == page; });
+                if (job != queue_.end() && job != queue_.begin()) {
+                    job->urgent = true;
+                    Job moved = std::move(*job);
+                    queue_.erase(job);
+                    queue_.push_front(std::move(moved));
+                }
+            }
+            return it->second;
+        }
+        if (!urgent && cache_.get(key(page))) return {};
+
+        Job job{key(page), {}, urgent};
+        std::shared_future<Slide> slide = job.promise.get_future().share();
+        pending_.emplace(page, slide);
+        if (urgent) {
+            queue_.push_front(std::move(job));
+        } else {
+            queue_.push_back(std::move(job));
+        }
+        post_task();
+        return slide;
+    }
+
+    // Caller holds `mutex_`
+    void post_task() {
+        ++tasks_;
+        pool_.post([this](fz_context *ctx) { run_next(ctx); });
+    }
+
+    // Pool task: run the most urgent queued job, if any is left (stale
+    // prefetches may have been dropped since the task was posted)
+    void run_next(fz_context *ctx) {
+        run_job(ctx);
+        std::lock_guard lock(mutex_);
+        if (--tasks_ == 0 || crops_.empty()) idle_cv_.notify_all();
+    }
+
+    void run_job(fz_context *ctx) {
+        Job job;
+        {
+            std::unique_lock lock(mutex_);
+            // Priorities: the slide the viewer waits for, visible tiles, crops, prefetches
+            const bool urgent = !queue_.empty() && queue_.front().urgent;
+            if (!urgent && !tiles_.empty()) {
+                TileKey tile = tiles_.front();
+                tiles_.pop_front();
+                lock.unlock();
+                return run_tile(ctx, tile);
+            }
+            bool slide_first = !queue_.empty() && (urgent || crops_.empty());
+            if (!slide_first) {
+                if (crops_.empty()) return;
+                if (MemoryLease lease = memory_budget().try_reserve(crop_bytes(crops_.front().box))) {
+                    CropJob crop = std::move(crops_.front());
+                    crops_.pop_front();
+                    lock.unlock();
+                    return run_crop(ctx, crop, std::move(lease));
+                }
+                // No room for the crop yet: render a prefetch instead, or give
+                // the task back until `retry_crops`
+                if (queue_.empty()) {
+                    ++stalled_;
+                    return;
+                }
+            }
+            job = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        cv::Mat fresh; // newly rendered, for the on-disk cache
+        try {
+            StageTimer timer(metrics().slide_render);
+            std::optional<Raster> full = disk_cache_.load(job.key);
+            if (full) {
+                ++metrics().render_cache_hits;
+            } else {
+                full = Raster{render_page(ctx, job.key.page), nullptr};
+                fresh = full->img;
+            }
+            ++metrics().slides_rendered;
+            Slide slide = make_slide(std::move(*full), opts_.display_max);
+            if (opts_.propose) slide.proposals = propose(ctx, job.key.page, slide);
+            {
+                std::lock_guard lock(mutex_);
+                cache_.put(job.key, slide, slide.bytes());
+                pending_.erase(job.key.page);
+            }
+            job.promise.set_value(std::move(slide));
+        } catch (...) {
+            {
+                std::lock_guard lock(mutex_);
+                pending_.erase(job.key.page);
+            }
+            job.promise.set_exception(std::current_exception());
+        }
+        // Only after the promise, so the viewer does not wait for the file write
+        if (!fresh.empty()) disk_cache_.store(job.key, fresh);
+    }
+
+    // Box proposals for a freshly rendered slide. Runs on the pool, so it is
+    // done ahead of time for prefetched slides; failures only cost the proposals.
+    std::vector<cv::Rect> propose(fz_context *ctx, int page_idx, const Slide &slide) {
+        const double scale = slide.display_scale;
+        auto scaled = [](cv::Rect r, double s) {
+            return cv::Rect(cvRound(r.x * s), cvRound(r.y * s), cvRound(r.width * s), cvRound(r.height * s));
+        };
+        try {
+            std::vector<cv::Rect> hints;
+            if (opts_.propose_text) {
+                for (const cv::Rect &r : text_blocks(ctx, page_idx)) hints.push_back(scaled(r, scale));
+            }
+            std::vector<cv::Rect> boxes = propose_regions(slide.display, hints);
+            for (cv::Rect &r : boxes) r = scaled(r, 1.0 / scale);
+            return boxes;
+        } catch (const std::exception &ex) {
+            std::cerr << "[Propose] Slide " << page_idx + 1 << ": " << ex.what() << "\n";
+            return {};
+        }
+    }
+
+    // Bounds of the text blocks in the page's text layer, in slide raster px
+    std::vector<cv::Rect> text_blocks(fz_context *ctx, int page_idx) {
+        PageList page = page_list(ctx, page_idx);
+        const fz_rect bbox = page.bounds;
+        fz_stext_page *text = nullptr;
+        bool failed = false;
+        fz_var(text);
+        fz_try(ctx) {
+            text = fz_new_stext_page_from_display_list(ctx, page.list.get(), nullptr);
+        }
+        fz_catch(ctx) {
+            failed = true;
+        }
+        if (failed) throw std::runtime_error(std::string("Cannot extract text: ") + fz_caught_message(ctx));
+
+        const float px = RenderConfig::DPI / 72.0f;
+        std::vector<cv::Rect> blocks;
+        for (fz_stext_block *block = text->first_block; block; block = block->next) {
+            if (block->type != FZ_STEXT_BLOCK_TEXT) continue;
+            const fz_rect &r = block->bbox;
+            blocks.emplace_back(cv::Point(cvFloor((r.x0 - bbox.x0) * px), cvFloor((r.y0 - bbox.y0) * px)),
+                cv::Point(cvCeil((r.x1 - bbox.x0) * px), cvCeil((r.y1 - bbox.y0) * px)));
+        }
+        fz_drop_stext_page(ctx, text);
+        return blocks;
+    }
+
+    void run_tile(fz_context *ctx, const TileKey &key) {
+        cv::Mat tile;
+        try {
+            StageTimer timer(metrics().tile_render);
+            tile = render_tile(ctx, key);
+        } catch (const std::exception &ex) {
+            std::cerr << "[Tile] Slide " << key.page + 1 << ": " << ex.what() << "\n";
+        }
+        std::lock_guard lock(mutex_);
+        tiles_pending_.erase(key);
+        if (tile.empty()) return;
+        // A tile that could not be cached would only be asked for again
+        if (tile_cache_.put(key, tile, mat_bytes(tile))) ++tile_generation_;
+    }
+
+    // Memory budget listener: re-post the tasks crops gave back
+    void retry_crops() {
+        std::lock_guard lock(mutex_);
+        if (crops_.empty()) stalled_ = 0;
+        for (; stalled_ > 0; --stalled_) post_task();
+    }
+
+    void run_crop(fz_context *ctx, CropJob &crop, MemoryLease lease) {
+        StageTimer timer(metrics().crop_render);
+        try {
+            crop.done(render_region(ctx, crop.page, crop.box), std::move(lease));
+        } catch (const std::exception &ex) {
+            std::cerr << "[Crop] Slide " << crop.page + 1 << ": " << ex.what() << "\n";
+        }
+    }
+
+    // Record `page_idx` into a display list; returns it with the page bounds in points
+    std::pair<fz_display_list *, fz_rect> load_page(fz_context *ctx, int page_idx) {
+        std::lock_guard lock(doc_mutex_);
+        fz_page *page = nullptr;
+        fz_display_list *list = nullptr;
+        fz_rect bbox{};
+        bool failed = false;
+        fz_var(page);
+        fz_try(ctx) {
+            page = fz_load_page(ctx, doc_, page_idx);
+            bbox = fz_bound_page(ctx, page);
+            list = fz_new_display_list_from_page(ctx, page);
+        }
+        fz_always(ctx) {
+            fz_drop_page(ctx, page);
+        }
+        fz_catch(ctx) {
+            failed = true;
+        }
+        if (failed) {
+            throw std::runtime_error("Cannot load slide " + std::to_string(page_idx + 1) + ": " +
+                                     fz_caught_message(ctx));
+        }
+        return {list, bbox};
+    }
+
+    struct PageList {
+        std::shared_ptr<fz_display_list> list; // dropped via `ctx_` once unused and evicted
+        fz_rect bounds;                        // page bounds in points
+    };
+
+    // Display list of `page_idx`, recorded from the PDF on first use and then
+    // replayed for every render of that page, whatever the scale, clip or
+    // colorspace: the slide, its crops and the text layer share one parse
+    PageList page_list(fz_context *ctx, int page_idx) {
+        {
+            std::lock_guard lock(lists_mutex_);
+            if (auto cached = lists_.get(page_idx)) return *cached;
+        }
+        auto [list, bounds] = load_page(ctx, page_idx);
+        PageList page{std::shared_ptr<fz_display_list>(list, [this](fz_display_list *l) { drop_list(l); }), bounds};
+        std::lock_guard lock(lists_mutex_);
+        if (auto cached = lists_.get(page_idx)) return *cached; // another thread was faster
+        lists_.put(page_idx, page, 1);
+        return page;
+    }
+
+    // The last reference can go away on any thread, so drop through `ctx_`
+    void drop_list(fz_display_list *list) {
+        std::lock_guard lock(ctx_mutex_);
+        fz_drop_display_list(ctx_, list);
+    }
+
+    cv::Mat render_page(fz_context *ctx, int page_idx) {
+        PageList page = page_list(ctx, page_idx);
+        fz_matrix mtx = fz_scale(RenderConfig::DPI / 72.0f, RenderConfig::DPI / 72.0f);
+        fz_irect bounds = fz_round_rect(fz_transform_rect(page.bounds, mtx));
+        return rasterize(ctx, page.list.get(), mtx, bounds, opts_.colorspace);
+    }
+
+    // Render one TILE_SIZE square of the page at `key.scale`, clipped to the page
+    cv::Mat render_tile(fz_context *ctx, const TileKey &key) {
+        PageList page = page_list(ctx, key.page);
+        const float s = static_cast<float>(key.scale);
+        fz_matrix mtx = fz_scale(s, s);
+        fz_irect bounds = fz_round_rect(fz_transform_rect(page.bounds, mtx));
+        const int size = RenderConfig::TILE_SIZE;
+        fz_irect area{bounds.x0 + key.tx * size, bounds.y0 + key.ty * size,
+            std::min(bounds.x0 + (key.tx + 1) * size, bounds.x1), std::min(bounds.y0 + (key.ty + 1) * size, bounds.y1)};
+        if (area.x0 >= area.x1 || area.y0 >= area.y1) return {};
+        return rasterize(ctx, page.list.get(), mtx, area, opts_.colorspace);
+    }
+
+    // Render only `box` (points from the page's top-left corner) at the crop DPI
+    // Size of `box` rendered by `render_region`, before rendering it
+    std::size_t crop_bytes(const fz_rect &box) const {
+        const double px = opts_.crop_dpi / 72.0;
+        const std::size_t w = static_cast<std::size_t>(std::ceil((box.x1 - box.x0) * px)) + 1;
+        const std::size_t h = static_cast<std::size_t>(std::ceil((box.y1 - box.y0) * px)) + 1;
+        return w * h * (opts_.crop_colorspace == Colorspace::Gray ? 1 : 3);
+    }
+
+    cv::Mat render_region(fz_context *ctx, int page_idx, fz_rect box) {
+        PageList page = page_list(ctx, page_idx);
+        const fz_rect &bbox = page.bounds;
+        fz_rect clip{box.x0 + bbox.x0, box.y0 + bbox.y0, box.x1 + bbox.x0, box.y1 + bbox.y0};
+        fz_matrix mtx = fz_scale(opts_.crop_dpi / 72.0f, opts_.crop_dpi / 72.0f);
+        fz_irect area = fz_round_rect(fz_transform_rect(clip, mtx));
+        return rasterize(ctx, page.list.get(), mtx, area, opts_.crop_colorspace);
+    }
+
+    RenderPool &pool_;
+    fz_context *ctx_ = nullptr;  // opens and drops the document and display lists
+    std::mutex ctx_mutex_;
+    fz_document *doc_ = nullptr; // shared, guarded by doc_mutex_
+    std::mutex doc_mutex_;
+    std::mutex lists_mutex_;
+    LruCache<int, PageList> lists_{RenderConfig::PAGE_LISTS}; // budget counts pages
+    int page_count_ = 0;
+    RenderOptions opts_;
+
+    std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    std::deque<Job> queue_;
+    std::deque<CropJob> crops_;
+    std::deque<TileKey> tiles_;
+    std::unordered_set<TileKey, TileKeyHash> tiles_pending_; // queued or rendering
+    LruCache<TileKey, cv::Mat, TileKeyHash> tile_cache_;
+    std::atomic<std::uint64_t> tile_generation_{0};
+    std::size_t tasks_ = 0;   // posted to the pool and not finished yet
+    std::size_t stalled_ = 0; // tasks that found no room for a crop, owed to `crops_`
+    int listener_ = -1;       // memory budget subscription
+    std::unordered_map<int, std::shared_future<Slide>> pending_; // queued or rendering
+    LruCache<SlideKey, Slide, SlideKeyHash> cache_;
+    DiskRenderCache disk_cache_;
+};
+
+// Bounding-box annotation helper class
+//
+// Redraws are event driven: mouse and key handlers patch only the affected
+// region of a persistent frame buffer and mark it dirty, and the loop calls
+// `imshow` only when something actually changed.
+//
+// At 100% the window shows the slide's screen-sized display image 1:1, so
+// drawing cost does not depend on the render DPI. Zooming in (wheel, +/-, 0 to
+// reset) switches to tiles: the window's area of the page is rendered at the
+// zoomed scale in RenderConfig::TILE_SIZE squares by the render pool and
+// cached there, so only visible tiles are ever rasterised. Until a tile
+// arrives its place shows the display image scaled up. Middle-drag pans.
+//
+// Boxes are kept in full-resolution coordinates and only mapped through the
+// current view (zoom and pan offset) for drawing.
+class BoxDrawer {
+public:
+    BoxDrawer(SlideRenderer &renderer, const Slide &slide, int slide_idx, int total_slides,
+        std::vector<std::pair<cv::Point, cv::Point>> initial_boxes = {})
+        : renderer_(renderer), page_(slide_idx), display_(slide.display), view_(slide.display.size()),
+          full_size_(slide.full.img.size()), scale_(slide.display_scale), boxes_(std::move(initial_boxes)) {
+        compose();
+
+        cv::namedWindow(ViewerConfig::WINDOW_NAME, cv::WINDOW_AUTOSIZE);
+        cv::moveWindow(ViewerConfig::WINDOW_NAME, ViewerConfig::WINDOW_X, ViewerConfig::WINDOW_Y);
+        cv::setMouseCallback(ViewerConfig::WINDOW_NAME, &BoxDrawer::mouseCallback, this);
+
+        char title[128];
+        std::snprintf(title, sizeof(title), ViewerConfig::TITLE_FMT,
+            ViewerConfig::WINDOW_NAME, slide_idx + 1, total_slides);
+        cv::setWindowTitle(ViewerConfig::WINDOW_NAME, title);
+    }
+
+    // Return value: "next", "back", or "quit"
+    std::string run(std::vector<std::pair<cv::Point, cv::Point>> &out_boxes) {
+        while (true) {
+            if (tiles_missing_ && renderer_.tile_generation() != tile_generation_) recompose_ = true;
+            if (recompose_) compose();
+            if (dirty_) {
+                cv::imshow(ViewerConfig::WINDOW_NAME, frame_);
+                dirty_ = false;
+            }
+            // Blocks in the GUI event loop; mouse callbacks run from inside it
+            int key = cv::waitKey(ViewerConfig::POLL_MS);
+            if (key == Key::NEXT) {
+                out_boxes = boxes_;
+                return "next";
+            }
+            if (key == Key::PREV) {
+                out_boxes = boxes_;
+                return "back";
+            }
+            if (key == Key::ESC) {
+                out_boxes.clear();
+                return "quit";
+            }
+            if (key == Key::UNDO && !boxes_.empty()) {
+                cv::Rect removed = bounds(boxes_.back());
+                boxes_.pop_back();
+                repaint(removed);
+            }
+            if (key == Key::CLEAR && !boxes_.empty()) {
+                boxes_.clear();
+                base_.copyTo(frame_);
+                dirty_ = true;
+            }
+            const cv::Point center{view_.width / 2, view_.height / 2};
+            if (key == Key::ZOOM_IN || key == Key::ZOOM_IN_ALT) set_zoom(zoom_level_ + 1, center);
+            if (key == Key::ZOOM_OUT) set_zoom(zoom_level_ - 1, center);
+            if (key == Key::ZOOM_RESET) set_zoom(0, center);
+        }
+    }
+
+private:
+    using Box = std::pair<cv::Point, cv::Point>;
+
+    static void mouseCallback(int event, int x, int y, int flags, void *userdata) {
+        auto *self = static_cast<BoxDrawer *>(userdata);
+        if (event == cv::EVENT_LBUTTONDOWN) {
+            self->start_ = self->to_full({x, y});
+        } else if (event == cv::EVENT_LBUTTONUP && self->start_.has_value()) {
+            self->boxes_.emplace_back(*self->start_, self->to_full({x, y}));
+            self->start_.reset();
+            self->draw(self->frame_, self->boxes_.back(), {0, 0});
+            self->dirty_ = true;
+        } else if (event == cv::EVENT_RBUTTONDOWN) {
+            self->remove_at(self->to_full({x, y}));
+        } else if (event == cv::EVENT_MOUSEWHEEL) {
+            self->set_zoom(self->zoom_level_ + (cv::getMouseWheelDelta(flags) > 0 ? 1 : -1), {x, y});
+        } else if (event == cv::EVENT_MBUTTONDOWN) {
+            self->pan_from_ = cv::Point{x, y};
+            self->pan_offset_ = self->offset_;
+        } else if (event == cv::EVENT_MBUTTONUP) {
+            self->pan_from_.reset();
+        } else if (event == cv::EVENT_MOUSEMOVE && self->pan_from_ && (flags & cv::EVENT_FLAG_MBUTTON)) {
+            self->offset_ = self->pan_offset_ - (cv::Point{x, y} - *self->pan_from_);
+            self->clamp_offset();
+            self->recompose_ = true; // once per loop iteration, however many moves arrive
+        }
+    }
+
+    // Delete the topmost (most recently added) box containing `p`
+    void remove_at(cv::Point p) {
+        for (auto it = boxes_.rbegin(); it != boxes_.rend(); ++it) {
+            cv::Point a = it->first, b = it->second;
+            if (p.x < std::min(a.x, b.x) || p.x > std::max(a.x, b.x) ||
+                p.y < std::min(a.y, b.y) || p.y > std::max(a.y, b.y)) {
+                continue;
+            }
+            cv::Rect removed = bounds(*it);
+            boxes_.erase(std::next(it).base());
+            repaint(removed);
+            return;
+        }
+    }
+
+    double zoom() const { return ViewerConfig::ZOOM_LEVELS[static_cast<std::size_t>(zoom_level_)]; }
+
+    // View px per full-resolution px
+    double view_scale() const { return scale_ * zoom(); }
+
+    // The whole page at the current zoom, in view px
+    cv::Size zoomed_size() const {
+        return {cvRound(full_size_.width * view_scale()), cvRound(full_size_.height * view_scale())};
+    }
+
+    cv::Point to_full(cv::Point p) const {
+        return {cvRound((p.x + offset_.x) / view_scale()), cvRound((p.y + offset_.y) / view_scale())};
+    }
+    cv::Point to_view(cv::Point p) const {
+        return {cvRound(p.x * view_scale()) - offset_.x, cvRound(p.y * view_scale()) - offset_.y};
+    }
+
+    // Change the zoom step, keeping the page point under `anchor` (view px) in place
+    void set_zoom(int level, cv::Point anchor) {
+        level = std::clamp(level, 0, static_cast<int>(ViewerConfig::ZOOM_LEVELS.size()) - 1);
+        if (level == zoom_level_) return;
+        const double fx = (anchor.x + offset_.x) / view_scale();
+        const double fy = (anchor.y + offset_.y) / view_scale();
+        zoom_level_ = level;
+        offset_ = {cvRound(fx * view_scale()) - anchor.x, cvRound(fy * view_scale()) - anchor.y};
+        clamp_offset();
+        recompose_ = true;
+    }
+
+    void clamp_offset() {
+        cv::Size page = zoomed_size();
+        offset_.x = std::clamp(offset_.x, 0, std::max(0, page.width - view_.width));
+        offset_.y = std::clamp(offset_.y, 0, std::max(0, page.height - view_.height));
+    }
+
+    // Rebuild the background for the current zoom and pan, then the boxes on top
+    void compose() {
+        recompose_ = false;
+        tiles_missing_ = false;
+        if (zoom_level_ == 0) {
+            base_ = display_;
+        } else {
+            tile_generation_ = renderer_.tile_generation(); // before asking, so no arrival is missed
+            compose_placeholder();
+            compose_tiles();
+        }
+        frame_ = base_.clone();
+        for (const auto &box : boxes_) draw(frame_, box, {0, 0});
+        dirty_ = true;
+    }
+
+    // The display image scaled up to the zoom, shown until the tiles arrive
+    void compose_placeholder() {
+        const double z = zoom();
+        cv::Rect src = cv::Rect(cvFloor(offset_.x / z), cvFloor(offset_.y / z), cvCeil(view_.width / z) + 1,
+                           cvCeil(view_.height / z) + 1) &
+                       cv::Rect(0, 0, display_.cols, display_.rows);
+        base_ = cv::Mat(view_, display_.type(), cv::Scalar(255, 255, 255));
+        if (src.empty()) return;
+        cv::Mat up;
+        cv::resize(display_(src), up, cv::Size(cvRound(src.width * z), cvRound(src.height * z)), 0, 0,
+            cv::INTER_LINEAR);
+        cv::Rect from = cv::Rect(offset_.x - cvRound(src.x * z), offset_.y - cvRound(src.y * z), view_.width,
+                            view_.height) &
+                        cv::Rect(0, 0, up.cols, up.rows);
+        cv::Mat dst = base_(cv::Rect(0, 0, from.width, from.height));
+        up(from).copyTo(dst);
+    }
+
+    // Copy the visible tiles the renderer has ready; the rest get queued
+    void compose_tiles() {
+        const int size = RenderConfig::TILE_SIZE;
+        const cv::Size page = zoomed_size();
+        const int tx_end = std::min(offset_.x + view_.width, page.width);
+        const int ty_end = std::min(offset_.y + view_.height, page.height);
+        const double scale = RenderConfig::DPI / 72.0 * view_scale(); // px per point
+        std::vector<TileKey> wanted;
+        for (int ty = offset_.y / size; ty * size < ty_end; ++ty) {
+            for (int tx = offset_.x / size; tx * size < tx_end; ++tx) wanted.push_back({page_, scale, tx, ty});
+        }
+
+        std::vector<cv::Mat> tiles = renderer_.tiles(wanted);
+        const cv::Rect view(0, 0, view_.width, view_.height);
+        for (std::size_t i = 0; i < wanted.size(); ++i) {
+            if (tiles[i].empty()) {
+                tiles_missing_ = true;
+                continue;
+            }
+            cv::Rect at(wanted[i].tx * size - offset_.x, wanted[i].ty * size - offset_.y, tiles[i].cols,
+                tiles[i].rows);
+            cv::Rect visible = at & view;
+            if (visible.empty()) continue;
+            cv::Mat dst = base_(visible);
+            tiles[i](cv::Rect(visible.x - at.x, visible.y - at.y, visible.width, visible.height)).copyTo(dst);
+        }
+    }
+
+    // Draw `box` into `canvas`, whose top-left corner is at view pixel `origin`
+    void draw(cv::Mat &canvas, const Box &box, cv::Point origin) const {
+        cv::rectangle(canvas, to_view(box.first) - origin, to_view(box.second) - origin,
+            ViewerConfig::RECT_COLOR, ViewerConfig::RECT_THICKNESS);
+    }
+
+    // View pixels touched when drawing `box`
+    cv::Rect bounds(const Box &box) const {
+        const int pad = ViewerConfig::RECT_THICKNESS;
+        cv::Point a = to_view(box.first);
+        cv::Point b = to_view(box.second);
+        return {cv::Point{std::min(a.x, b.x) - pad, std::min(a.y, b.y) - pad},
+            cv::Point{std::max(a.x, b.x) + pad + 1, std::max(a.y, b.y) + pad + 1}};
+    }
+
+    // Restore `region` from the background and redraw the boxes overlapping it
+    void repaint(cv::Rect region) {
+        region &= cv::Rect(0, 0, frame_.cols, frame_.rows);
+        if (region.empty()) return;
+        cv::Mat patch = frame_(region);
+        base_(region).copyTo(patch);
+        for (const auto &box : boxes_) {
+            if ((bounds(box) & region).empty()) continue;
+            draw(patch, box, region.tl());
+        }
+        dirty_ = true;
+    }
+
+    SlideRenderer &renderer_;
+    int page_;
+    cv::Mat display_;     // display image shared with the renderer, never written
+    cv::Size view_;       // window size (the display image's)
+    cv::Size full_size_;  // full-resolution slide raster
+    double scale_;        // display px per full-resolution px
+    cv::Mat base_;        // background for the current view: display_ or tiles
+    cv::Mat frame_;       // base_ plus overlays, patched in place
+    std::vector<Box> boxes_; // full-resolution coordinates
+    bool dirty_ = true;
+    std::optional<cv::Point> start_;
+
+    int zoom_level_ = 0;  // index into ViewerConfig::ZOOM_LEVELS
+    cv::Point offset_;    // view px: top-left of the window within the zoomed page
+    std::optional<cv::Point> pan_from_;
+    cv::Point pan_offset_;
+    bool recompose_ = false;
+    bool tiles_missing_ = false;
+    std::uint64_t tile_generation_ = 0;
+};
+
+// Background crop writer
+//
+// Encoding and writing run on a small thread pool fed by a bounded queue.
+// `submit` only blocks when the queue is full, which throttles the producer
+// instead of letting encoded-but-unwritten crops pile up in memory. The
+// destructor writes everything still queued before joining.
+class CropWriter {
+public:
+    CropWriter(int threads, std::size_t capacity, const EncodeOptions &encode)
+        : capacity_(std::max<std::size_t>(capacity, 1)), params_(encode.imwrite_params()) {
+        for (int i = 0; i < std::max(threads, 1); ++i) {
+            threads_.emplace_back(&CropWriter::worker_loop, this);
+        }
+    }
+
+    ~CropWriter() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        not_empty_.notify_all();
+        for (auto &t : threads_) t.join();
+    }
+
+    CropWriter(const CropWriter &) = delete;
+    CropWriter &operator=(const CropWriter &) = delete;
+
+    // `lease` is released once the crop is written
+    void submit(fs::path path, cv::Mat crop, MemoryLease lease = {}) {
+        {
+            std::unique_lock lock(mutex_);
+            not_full_.wait(lock, [&] { return queue_.size() < capacity_; });
+            queue_.push_back({std::move(path), std::move(crop), std::move(lease)});
+        }
+        ++metrics().writer_queue;
+        not_empty_.notify_one();
+    }
+
+    // Block until every submitted crop has been written
+    void flush() {
+        std::unique_lock lock(mutex_);
+        idle_.wait(lock, [&] { return queue_.empty() && busy_ == 0; });
+    }
+
+private:
+    struct Item {
+        fs::path path;
+        cv::Mat crop;
+        MemoryLease lease;
+    };
+
+    void worker_loop() {
+        while (true) {
+            Item item;
+            {
+                std::unique_lock lock(mutex_);
+                not_empty_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return; // stopping and drained
+                item = std::move(queue_.front());
+                queue_.pop_front();
+                ++busy_;
+            }
+            not_full_.notify_one();
+            --metrics().writer_queue;
+
+            bool written = false;
+            try {
+                StageTimer timer(metrics().crop_write);
+                written = cv::imwrite(item.path.string(), item.crop, params_);
+            } catch (const cv::Exception &ex) { // e.g. no encoder for the format, empty crop
+                std::cerr << "[Writer] " << item.path.filename().string() << ": " << ex.what() << "\n";
+            }
+            if (written) {
+                ++metrics().crops_written;
+                std::cout << "[Writer] Saved " << item.path.filename().string() << "\n";
+            } else {
+                std::cerr << "[Writer] Failed to write " << item.path << "\n";
+            }
+
+            {
+                std::lock_guard lock(mutex_);
+                --busy_;
+            }
+            idle_.notify_all();
+        }
+    }
+
+    std::size_t capacity_;
+    std::vector<int> params_; // format picked by the file extension
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::condition_variable idle_;
+    std::deque<Item> queue_;
+    int busy_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// Minimal JSON reader, just enough for box specification files
+struct Json {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+    Type type = Type::Null;
+    double number = 0.0;
+    std::string string;
+    std::vector<Json> array;
+    std::vector<std::pair<std::string, Json>> object;
+
+    const Json *find(const std::string &key) const {
+        for (const auto &[k, v] : object) {
+            if (k == key) return &v;
+        }
+        return nullptr;
+    }
+
+    static Json parse(const std::string &text) {
+        std::size_t pos = 0;
+        Json value = parse_value(text, pos);
+        skip_ws(text, pos);
+        if (pos != text.size()) throw std::runtime_error("Trailing characters in JSON");
+        return value;
+    }
+
+private:
+    static void skip_ws(const std::string &t, std::size_t &pos) {
+        while (pos < t.size() && std::isspace(static_cast<unsigned char>(t[pos]))) ++pos;
+    }
+
+    static void expect(const std::string &t, std::size_t &pos, char c) {
+        skip_ws(t, pos);
+        if (pos >= t.size() || t[pos] != c) {
+            throw std::runtime_error(std::string("Expected '") + c + "' at offset " + std::to_string(pos) + " in JSON");
+        }
+        ++pos;
+    }
+
+    static std::string parse_string(const std::string &t, std::size_t &pos) {
+        expect(t, pos, '"');
+        std::string out;
+        while (pos < t.size() && t[pos] != '"') {
+            char c = t[pos++];
+            if (c == '\\' && pos < t.size()) {
+                char e = t[pos++];
+                out += e == 'n' ? '\n' : e == 't' ? '\t' : e;
+            } else {
+                out += c;
+            }
+        }
+        expect(t, pos, '"');
+        return out;
+    }
+
+    static Json parse_value(const std::string &t, std::size_t &pos) {
+        skip_ws(t, pos);
+        if (pos >= t.size()) throw std::runtime_error("Unexpected end of JSON");
+        Json v;
+        char c = t[pos];
+        if (c == '{') {
+            v.type = Type::Object;
+            ++pos;
+            skip_ws(t, pos);
+            if (pos < t.size() && t[pos] == '}') return ++pos, v;
+            do {
+                std::string key = parse_string(t, pos);
+                expect(t, pos, ':');
+                v.object.emplace_back(std::move(key), parse_value(t, pos));
+                skip_ws(t, pos);
+            } while (pos < t.size() && t[pos] == ',' && ++pos);
+            expect(t, pos, '}');
+        } else if (c == '[') {
+            v.type = Type::Array;
+            ++pos;
+            skip_ws(t, pos);
+            if (pos < t.size() && t[pos] == ']') return ++pos, v;
+            do {
+                v.array.push_back(parse_value(t, pos));
+                skip_ws(t, pos);
+            } while (pos < t.size() && t[pos] == ',' && ++pos);
+            expect(t, pos, ']');
+        } else if (c == '"') {
+            v.type = Type::String;
+            v.string = parse_string(t, pos);
+        } else if (t.compare(pos, 4, "true") == 0 || t.compare(pos, 5, "false") == 0) {
+            v.type = Type::Bool;
+            v.number = t[pos] == 't';
+            pos += t[pos] == 't' ? 4 : 5;
+        } else if (t.compare(pos, 4, "null") == 0) {
+            pos += 4;
+        } else {
+            v.type = Type::Number;
+            const char *begin = t.c_str() + pos;
+            char *end = nullptr;
+            v.number = std::strtod(begin, &end);
+            if (end == begin) throw std::runtime_error("Bad value at offset " + std::to_string(pos) + " in JSON");
+            pos += static_cast<std::size_t>(end - begin);
+        }
+        return v;
+    }
+};
+
+// Boxes per page (0-based), in PDF points from the page's top-left corner
+//
+// On disk (pages 1-based):
+//   {"pages": [{"page": 1, "boxes": [[x0, y0, x1, y1], ...]}, ...]}
+using BoxSpec = std::map<int, std::vector<fz_rect>>;
+
+static BoxSpec load_box_spec(const fs::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot read box spec " + path.string());
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    BoxSpec spec;
+    Json root = Json::parse(text);
+    const Json *pages = root.find("pages");
+    if (!pages || pages->type != Json::Type::Array) {
+        throw std::runtime_error("Box spec " + path.string() + " has no \"pages\" array");
+    }
+    for (const Json &entry : pages->array) {
+        const Json *page = entry.find("page");
+        const Json *boxes = entry.find("boxes");
+        if (!page || !boxes || page->type != Json::Type::Number || boxes->type != Json::Type::Array) {
+            throw std::runtime_error("Box spec entries need \"page\" and \"boxes\"");
+        }
+        const int page_num = static_cast<int>(page->number);
+        if (page_num < 1) {
+            std::cerr << "[Boxes] " << path.filename().string() << ": skipping page " << page->number << "\n";
+            continue;
+        }
+        auto &rects = spec[page_num - 1];
+        for (const Json &box : boxes->array) {
+            const bool numbers = box.type == Json::Type::Array && box.array.size() == 4 &&
+                                 std::all_of(box.array.begin(), box.array.end(),
+                                     [](const Json &v) { return v.type == Json::Type::Number; });
+            if (!numbers) {
+                std::cerr << "[Boxes] Page " << page_num << ": skipping a box that is not [x0, y0, x1, y1]\n";
+                continue;
+            }
+            // Corners in either order, like boxes drawn in the GUI
+            const double x0 = box.array[0].number, y0 = box.array[1].number;
+            const double x1 = box.array[2].number, y1 = box.array[3].number;
+            fz_rect rect{static_cast<float>(std::min(x0, x1)), static_cast<float>(std::min(y0, y1)),
+                static_cast<float>(std::max(x0, x1)), static_cast<float>(std::max(y0, y1))};
+            if (rect.x1 - rect.x0 <= 0 || rect.y1 - rect.y0 <= 0) {
+                std::cerr << "[Boxes] Page " << page_num << ": skipping an empty box\n";
+                continue;
+            }
+            rects.push_back(rect);
+        }
+    }
+    return spec;
+}
+
+// Pages without boxes are written too (`"boxes": []`): a page the annotator
+// cleared is a decision, and must not get proposals again next session
+static void write_box_spec(const fs::path &path, const BoxSpec &spec) {
+    std::string out = "{\"pages\": [";
+    bool first_page = true;
+    for (const auto &[page, rects] : spec) {
+        out += first_page ? "\n" : ",\n";
+        first_page = false;
+        out += "  {\"page\": " + std::to_string(page + 1) + ", \"boxes\": [";
+        for (std::size_t i = 0; i < rects.size(); ++i) {
+            char box[96];
+            std::snprintf(box, sizeof(box), "%s[%.2f, %.2f, %.2f, %.2f]", i ? ", " : "",
+                rects[i].x0, rects[i].y0, rects[i].x1, rects[i].y1);
+            out += box;
+        }
+        out += "]}";
+    }
+    out += "\n]}\n";
+    if (!write_file_atomic(path, out)) throw std::runtime_error("Cannot write box spec " + path.string());
+}
+
+// Viewer boxes (slide raster pixels, any corner order) -> page points, clamped to the slide
+static std::vector<fz_rect> boxes_to_points(const std::vector<std::pair<cv::Point, cv::Point>> &boxes,
+    cv::Size slide_size) {
+    const float to_pt = 72.0f / RenderConfig::DPI;
+    std::vector<fz_rect> rects;
+    for (const auto &[p1, p2] : boxes) {
+        int x1 = std::clamp(std::min(p1.x, p2.x), 0, slide_size.width);
+        int x2 = std::clamp(std::max(p1.x, p2.x), 0, slide_size.width);
+        int y1 = std::clamp(std::min(p1.y, p2.y), 0, slide_size.height);
+        int y2 = std::clamp(std::max(p1.y, p2.y), 0, slide_size.height);
+        if (x2 - x1 == 0 || y2 - y1 == 0) continue; // empty crop
+        rects.push_back({x1 * to_pt, y1 * to_pt, x2 * to_pt, y2 * to_pt});
+    }
+    return rects;
+}
+
+// Page points -> viewer boxes
+static std::vector<std::pair<cv::Point, cv::Point>> points_to_boxes(const std::vector<fz_rect> &rects) {
+    const float to_px = RenderConfig::DPI / 72.0f;
+    std::vector<std::pair<cv::Point, cv::Point>> boxes;
+    for (const auto &r : rects) {
+        boxes.emplace_back(cv::Point{cvRound(r.x0 * to_px), cvRound(r.y0 * to_px)},
+            cv::Point{cvRound(r.x1 * to_px), cvRound(r.y1 * to_px)});
+    }
+    return boxes;
+}
+
+// Save image crops for one slide
+//
+// Each crop is re-rendered by the render thread, handed to OCR in memory and,
+// if `writer` is set, encoded to disk in parallel; this returns immediately.
+static void save_crops(SlideRenderer &renderer,
+    CropWriter *writer,
+    OcrPool &ocr,
+    const std::vector<fz_rect> &boxes,
+    int slide_idx,
+    const fs::path &out_dir,
+    const std::string &extension) {
+    metrics().crops_queued += boxes.size();
+    int crop_idx = 1;
+    for (const fz_rect &box : boxes) {
+        char fname[64];
+        std::snprintf(fname, sizeof(fname), "slide_%03d_crop_%d%s", slide_idx + 1, crop_idx++, extension.c_str());
+        fs::path crop_path = out_dir / fname;
+        renderer.render_crop(slide_idx, box, [writer, &ocr, crop_path](cv::Mat crop, MemoryLease lease) {
+            if (crop.empty()) { // thinner than a pixel at the crop DPI
+                std::cerr << "[Crop] " << crop_path.filename().string() << " is empty, skipped\n";
+                return;
+            }
+            ocr.submit(crop_path, crop, lease);
+            if (writer) writer->submit(crop_path, std::move(crop), std::move(lease));
+        });
+    }
+}
+
+// Everything needed to turn boxes into crops and LaTeX
+struct ExtractOptions {
+    RenderOptions render;
+    EncodeOptions encode;
+    int writer_threads = WriterConfig::THREADS; // 0 = don't write crop images
+};
+
+// One PDF of a run and the folder its crops go to
+struct Deck {
+    fs::path pdf;
+    fs::path out_dir;
+};
+
+// Box specification for `deck`: `boxes` if given, else the boxes.json a
+// previous GUI session left in the deck's output folder, else <name>.boxes.json
+// next to the PDF
+static std::optional<fs::path> find_box_spec(const Deck &deck, const fs::path &boxes) {
+    if (!boxes.empty()) return boxes;
+    if (fs::exists(deck.out_dir / "boxes.json")) return deck.out_dir / "boxes.json";
+    fs::path beside = deck.pdf;
+    beside.replace_extension(".boxes.json");
+    if (fs::exists(beside)) return beside;
+    return std::nullopt;
+}
+
+// Annotate PDF deck & launch GUI
+//
+// Starts from `spec` (e.g. a previous session's boxes) and writes the final
+// boxes to <out_dir>/boxes.json, so the deck can be re-extracted headless.
+// Returns false if the user quit. The crops may still be rendering on return.
+static bool annotate_pdf(SlideRenderer &renderer, CropWriter *writer, OcrPool &ocr, const Deck &deck,
+    const ExtractOptions &opts, BoxSpec spec) {
+    const int page_count = renderer.page_count();
+
+    int slide_idx = 0;
+    while (slide_idx >= 0 && slide_idx < page_count) {
+        // Usually already rendered in the background while the previous slide was shown
+        Slide slide;
+        {
+            StageTimer waited(metrics().slide_wait);
+            slide = renderer.get(slide_idx);
+        }
+
+        // Boxes saved for this slide win; otherwise start from the proposals, if any
+        std::vector<std::pair<cv::Point, cv::Point>> initial;
+        if (auto saved = spec.find(slide_idx); saved != spec.end()) {
+            initial = points_to_boxes(saved->second);
+        } else {
+            for (const cv::Rect &r : slide.proposals) initial.emplace_back(r.tl(), r.br());
+        }
+        BoxDrawer drawer(renderer, slide, slide_idx, page_count, std::move(initial));
+        std::vector<std::pair<cv::Point, cv::Point>> boxes;
+        std::string action = drawer.run(boxes);
+
+        if (action == "quit") break;
+        spec[slide_idx] = boxes_to_points(boxes, slide.full.img.size());
+        save_crops(renderer, writer, ocr, spec[slide_idx], slide_idx, deck.out_dir, opts.encode.extension());
+        if (action == "back" && slide_idx > 0) {
+            --slide_idx;
+        } else if (action == "next") {
+            ++slide_idx;
+        }
+    }
+
+    cv::destroyAllWindows();
+    write_box_spec(deck.out_dir / "boxes.json", spec);
+    return slide_idx >= page_count;
+}
+
+// Queue crops for every box in `spec`; returns the number of crops
+static std::size_t queue_spec_crops(SlideRenderer &renderer, CropWriter *writer, OcrPool &ocr, const BoxSpec &spec,
+    const fs::path &out_dir, const std::string &extension) {
+    std::size_t crops = 0;
+    for (const auto &[page, boxes] : spec) {
+        if (page < 0 || page >= renderer.page_count()) {
+            std::cerr << "[Headless] Skipping page " << page + 1 << ": deck has " << renderer.page_count()
+                      << " pages\n";
+            continue;
+        }
+        save_crops(renderer, writer, ocr, boxes, page, out_dir, extension);
+        crops += boxes.size();
+    }
+    return crops;
+}
+
+static void print_progress(const char *tag, std::size_t idx, std::size_t count, const Deck &deck,
+    const std::string &what) {
+    std::cout << "[" << tag << "] (" << idx + 1 << "/" << count << ") " << deck.pdf.filename().string() << ": "
+              << what << "\n";
+}
+
+// Crop every box of every deck without the GUI and wait until all crops are OCR'd
+//
+// Decks are opened in order, at most BatchConfig::OPEN_DECKS at a time, and
+// all render on the shared pool, so one deck's last crops overlap with the
+// next deck's first ones. Decks without a box specification are skipped.
+static void extract_headless(RenderPool &pool, CropWriter *writer, OcrPool &ocr, const std::vector<Deck> &decks,
+    const ExtractOptions &opts, const fs::path &boxes) {
+    struct OpenDeck {
+        std::size_t idx;
+        std::unique_ptr<SlideRenderer> renderer;
+        std::size_t crops;
+    };
+    std::deque<OpenDeck> open;
+    auto close_oldest = [&] {
+        OpenDeck deck = std::move(open.front());
+        open.pop_front();
+        deck.renderer->finish_crops();
+        deck.renderer.reset();
+        print_progress("Batch", deck.idx, decks.size(), decks[deck.idx],
+            std::to_string(deck.crops) + " crops rendered; OCR " + std::to_string(ocr.done()) + "/" +
+                std::to_string(ocr.total()));
+    };
+
+    for (std::size_t i = 0; i < decks.size(); ++i) {
+        const Deck &deck = decks[i];
+        std::optional<fs::path> spec_path = find_box_spec(deck, boxes);
+        if (!spec_path) {
+            print_progress("Batch", i, decks.size(), deck, "no box specification, skipped");
+            continue;
+        }
+        try {
+            BoxSpec spec = load_box_spec(*spec_path);
+            fs::create_directories(deck.out_dir);
+            if (decks.size() > 1) ocr.watch(deck.out_dir);
+            auto renderer = std::make_unique<SlideRenderer>(pool, deck.pdf, opts.render);
+            std::size_t crops =
+                queue_spec_crops(*renderer, writer, ocr, spec, deck.out_dir, opts.encode.extension());
+            open.push_back({i, std::move(renderer), crops});
+        } catch (const std::exception &ex) {
+            print_progress("Batch", i, decks.size(), deck, std::string("skipped: ") + ex.what());
+            continue;
+        }
+        if (open.size() >= BatchConfig::OPEN_DECKS) close_oldest();
+    }
+    while (!open.empty()) close_oldest();
+
+    if (writer) writer->flush();
+    while (!ocr.wait_idle_for(BatchConfig::PROGRESS_INTERVAL)) {
+        std::cout << "[Batch] OCR " << ocr.done() << "/" << ocr.total() << "\n";
+    }
+    std::cout << "[Batch] OCR " << ocr.done() << "/" << ocr.total() << " crops done\n";
+}
+
+static bool is_pdf(const fs::path &path) {
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    return ext == ".pdf";
+}
+
+// Paths matching a shell wildcard pattern, sorted
+static std::vector<fs::path> expand_glob(const std::string &pattern) {
+    glob_t matches{};
+    int rc = ::glob(pattern.c_str(), 0, nullptr, &matches);
+    std::vector<fs::path> found;
+    if (rc == 0) found.assign(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+    globfree(&matches);
+    if (rc != 0 && rc != GLOB_NOMATCH) throw std::runtime_error("Cannot expand '" + pattern + "'");
+    return found;
+}
+
+// Expand PDF files, directories of PDFs and wildcard patterns into decks. A
+// single deck writes straight into `outdir`; several get one subfolder each,
+// named after the PDF.
+static std::vector<Deck> collect_decks(const std::vector<std::string> &inputs, const fs::path &outdir) {
+    std::vector<fs::path> pdfs;
+    for (const std::string &input : inputs) {
+        if (fs::is_directory(input)) {
+            std::vector<fs::path> found;
+            for (const auto &entry : fs::directory_iterator(input)) {
+                if (entry.is_regular_file() && is_pdf(entry.path())) found.push_back(entry.path());
+            }
+            std::sort(found.begin(), found.end());
+            pdfs.insert(pdfs.end(), found.begin(), found.end());
+        } else if (fs::exists(input)) {
+            pdfs.emplace_back(input);
+        } else if (input.find_first_of("*?[") != std::string::npos) {
+            for (fs::path &path : expand_glob(input)) {
+                if (fs::is_regular_file(path) && is_pdf(path)) pdfs.push_back(std::move(path));
+            }
+        } else {
+            throw std::runtime_error("PDF file not found: " + input);
+        }
+    }
+
+    std::vector<Deck> decks;
+    std::unordered_set<std::string> seen;
+    std::unordered_map<std::string, int> stems;
+    for (const fs::path &pdf : pdfs) {
+        fs::path abs = fs::weakly_canonical(fs::absolute(pdf));
+        if (!seen.insert(abs.string()).second) continue;
+        decks.push_back({abs, outdir});
+    }
+    if (decks.empty()) throw std::runtime_error("No PDF files found");
+    if (decks.size() > 1) {
+        for (Deck &deck : decks) {
+            std::string name = deck.pdf.stem().string();
+            if (int n = ++stems[name]; n > 1) name += "_" + std::to_string(n);
+            deck.out_dir = outdir / name;
+        }
+    }
+    return decks;
+}
+
+// $XDG_CACHE_HOME/extractor, falling back to ~/.cache
+static fs::path default_cache_dir() {
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return fs::path(xdg) / "extractor";
+    }
+    if (const char *home = std::getenv("HOME"); home && *home) {
+        return fs::path(home) / ".cache" / "extractor";
+    }
+    return {};
+}
+
+// Basic command-line parsing (positional inputs + options)
+struct CmdLine {
+    std::vector<std::string> inputs; // PDFs, directories or wildcard patterns
+    fs::path outdir = "latex_regions";
+    ExtractOptions extract;
+    fs::path boxes;        // --boxes spec.json
+    bool headless = false; // crop `boxes` without the GUI
+    OcrOptions ocr;
+    std::chrono::milliseconds stub_batch_latency = OcrConfig::STUB_BATCH_LATENCY;
+    std::chrono::milliseconds stub_crop_latency = OcrConfig::STUB_CROP_LATENCY;
+    std::chrono::seconds drain_timeout = OcrConfig::DRAIN_TIMEOUT;
+    fs::path metrics_file; // Prometheus text file; empty = summary lines only
+    std::chrono::seconds metrics_interval = MetricsConfig::SUMMARY_INTERVAL;
+    std::size_t memory_bytes = MemoryConfig::BUDGET_MB << 20; // 0 = unlimited
+};
+
+static CmdLine parse_arguments(int argc, char *argv[]) {
+    CmdLine cl;
+    if (fs::path cache = default_cache_dir(); !cache.empty()) {
+        cl.extract.render.disk_cache_dir = cache / "renders";
+        cl.ocr.result_cache = cache / "ocr_results.tsv";
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&](const char *what) -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Option '" + arg + "' expects " + what);
+            }
+            return argv[++i];
+        };
+        if (arg == "-o" || arg == "--out") {
+            cl.outdir = value("a directory");
+        } else if (arg == "--memory-mb") {
+            cl.memory_bytes = std::stoul(value("a size in MiB")) << 20;
+        } else if (arg == "--cache-mb") {
+            cl.extract.render.cache_bytes = std::stoul(value("a size in MiB")) << 20;
+        } else if (arg == "--render-cache") {
+            cl.extract.render.disk_cache_dir = value("a directory");
+        } else if (arg == "--render-cache-mb") {
+            cl.extract.render.disk_cache_bytes = static_cast<std::uintmax_t>(std::stoul(value("a size in MiB")))
+                                                 << 20;
+        } else if (arg == "--no-render-cache") {
+            cl.extract.render.disk_cache_dir.clear();
+        } else if (arg == "--render-threads") {
+            cl.extract.render.threads = std::stoi(value("a thread count"));
+        } else if (arg == "--crop-dpi") {
+            cl.extract.render.crop_dpi = std::stof(value("a resolution in dpi"));
+        } else if (arg == "--writers") {
+            cl.extract.writer_threads = std::stoi(value("a thread count"));
+        } else if (arg == "--format") {
+            std::string fmt = value("png, pnm or webp");
+            if (fmt == "png") {
+                cl.extract.encode.format = CropFormat::Png;
+            } else if (fmt == "pnm") {
+                cl.extract.encode.format = CropFormat::Pnm;
+            } else if (fmt == "webp") {
+                cl.extract.encode.format = CropFormat::Webp;
+            } else {
+                throw std::invalid_argument("Unknown crop format '" + fmt + "'");
+            }
+        } else if (arg == "--png-level") {
+            cl.extract.encode.png_level = std::clamp(std::stoi(value("a level 0-9")), 0, 9);
+        } else if (arg == "--png-strategy") {
+            static const std::unordered_map<std::string, int> strategies = {
+                {"default", cv::IMWRITE_PNG_STRATEGY_DEFAULT},
+                {"filtered", cv::IMWRITE_PNG_STRATEGY_FILTERED},
+                {"huffman", cv::IMWRITE_PNG_STRATEGY_HUFFMAN_ONLY},
+                {"rle", cv::IMWRITE_PNG_STRATEGY_RLE},
+                {"fixed", cv::IMWRITE_PNG_STRATEGY_FIXED}};
+            std::string name = value("default, filtered, huffman, rle or fixed");
+            auto it = strategies.find(name);
+            if (it == strategies.end()) throw std::invalid_argument("Unknown PNG strategy '" + name + "'");
+            cl.extract.encode.png_strategy = it->second;
+        } else if (arg == "--gray") {
+            cl.extract.encode.grayscale = true;
+            cl.extract.render.crop_colorspace = Colorspace::Gray;
+        } else if (arg == "--propose") {
+            cl.extract.render.propose = true;
+        } else if (arg == "--propose-text") {
+            cl.extract.render.propose = true;
+            cl.extract.render.propose_text = true;
+        } else if (arg == "--no-save-crops") {
+            cl.extract.writer_threads = 0;
+        } else if (arg == "--boxes") {
+            cl.boxes = value("a box specification file");
+        } else if (arg == "--headless") {
+            cl.headless = true;
+        } else if (arg == "--ocr-workers") {
+            cl.ocr.workers = std::stoi(value("a thread count"));
+        } else if (arg == "--ocr-batch") {
+            cl.ocr.max_batch = std::max(1, std::stoi(value("a batch size")));
+        } else if (arg == "--ocr-wait-ms") {
+            cl.ocr.max_wait = std::chrono::milliseconds(std::stoi(value("a time in ms")));
+        } else if (arg == "--ocr-cache") {
+            cl.ocr.result_cache = fs::absolute(value("a file"));
+        } else if (arg == "--no-ocr-cache") {
+            cl.ocr.result_cache.clear();
+        } else if (arg == "--dedup-distance") {
+            cl.ocr.dedup_distance = std::stoi(value("a bit count (negative = off)"));
+            if (cl.ocr.dedup_distance > 63) {
+                throw std::invalid_argument(
+                    "Option '--dedup-distance' expects at most 63 bits, got " + std::to_string(cl.ocr.dedup_distance));
+            }
+        } else if (arg == "--stub-latency") {
+            std::string spec = value("BATCH_MS:CROP_MS");
+            int batch_ms = 0, crop_ms = 0;
+            if (std::sscanf(spec.c_str(), "%d:%d", &batch_ms, &crop_ms) != 2 || batch_ms < 0 || crop_ms < 0) {
+                throw std::invalid_argument("Option '--stub-latency' expects BATCH_MS:CROP_MS, got '" + spec + "'");
+            }
+            cl.stub_batch_latency = std::chrono::milliseconds(batch_ms);
+            cl.stub_crop_latency = std::chrono::milliseconds(crop_ms);
+        } else if (arg == "--drain-seconds") {
+            cl.drain_timeout = std::chrono::seconds(std::max(0, std::stoi(value("a time in seconds"))));
+        } else if (arg == "--metrics") {
+            cl.metrics_file = value("a file");
+        } else if (arg == "--metrics-interval") {
+            cl.metrics_interval = std::chrono::seconds(std::max(0, std::stoi(value("a time in seconds"))));
+        } else if (arg == "--display") {
+            std::string size = value("a size like 1600x1000");
+            int w = 0, h = 0;
+            if (std::sscanf(size.c_str(), "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+                throw std::invalid_argument("Option '--display' expects WIDTHxHEIGHT, got '" + size + "'");
+            }
+            cl.extract.render.display_max = {w, h};
+        } else {
+            cl.inputs.push_back(arg);
+        }
+    }
+    if (cl.inputs.empty()) cl.inputs.push_back("slides.pdf");
+    // Encoders are optional in OpenCV builds (WebP in particular)
+    const std::string ext = cl.extract.encode.extension();
+    if (cl.extract.writer_threads > 0 && !cv::haveImageWriter(ext)) {
+        throw std::invalid_argument("This OpenCV build cannot write " + ext +
+                                    " images; pick another --format or use --no-save-crops");
+    }
+    return cl;
+}
+
+// Program entry
+int main(int argc, char *argv[]) {
+    try {
+        std::cout << "Annotate LaTeX regions in a PDF deck of slides.\n";
+        CmdLine cmd = parse_arguments(argc, argv);
+        cmd.outdir = fs::absolute(cmd.outdir);
+        std::vector<Deck> decks = collect_decks(cmd.inputs, cmd.outdir);
+        if (!cmd.boxes.empty() && decks.size() > 1) {
+            std::cerr << "--boxes takes a single PDF; batch runs read each deck's boxes.json\n";
+            return 1;
+        }
+        fs::create_directories(cmd.outdir);
+
+        memory_budget().set_limit(cmd.memory_bytes);
+
+        // Declared first so its final report covers everything below
+        MetricsReporter reporter(cmd.metrics_file, cmd.metrics_interval);
+
+        // Destroyed in reverse: the pool finishes rendering crops (which go to
+        // the writer and OCR) before the writer drains
+        OcrPool ocr(cmd.outdir, std::make_unique<StubOcrBackend>(cmd.stub_batch_latency, cmd.stub_crop_latency),
+            cmd.ocr);
+        std::optional<CropWriter> writer;
+        if (cmd.extract.writer_threads > 0) {
+            writer.emplace(cmd.extract.writer_threads, WriterConfig::QUEUE_CAPACITY, cmd.extract.encode);
+        }
+        RenderPool pool(cmd.extract.render.threads);
+        CropWriter *crop_writer = writer ? &*writer : nullptr;
+        // Annotated decks whose crops may still wait for memory behind OCR; the
+        // GUI moves on to the next deck meanwhile
+        std::vector<std::pair<const Deck *, std::unique_ptr<SlideRenderer>>> closing;
+
+        if (cmd.headless) {
+            extract_headless(pool, crop_writer, ocr, decks, cmd.extract, cmd.boxes);
+        } else {
+            for (std::size_t i = 0; i < decks.size(); ++i) {
+                const Deck &deck = decks[i];
+                std::unique_ptr<SlideRenderer> renderer;
+                bool finished = true;
+                try {
+                    std::optional<fs::path> spec_path = find_box_spec(deck, cmd.boxes);
+                    BoxSpec spec = spec_path ? load_box_spec(*spec_path) : BoxSpec{};
+                    fs::create_directories(deck.out_dir);
+                    if (decks.size() > 1) {
+                        ocr.watch(deck.out_dir);
+                        print_progress("Batch", i, decks.size(), deck,
+                            "annotating; OCR " + std::to_string(ocr.done()) + "/" + std::to_string(ocr.total()));
+                    }
+                    renderer = std::make_unique<SlideRenderer>(pool, deck.pdf, cmd.extract.render);
+                    finished = annotate_pdf(*renderer, crop_writer, ocr, deck, cmd.extract, std::move(spec));
+                } catch (const std::exception &ex) {
+                    cv::destroyAllWindows();
+                    print_progress("Batch", i, decks.size(), deck, std::string("skipped: ") + ex.what());
+                }
+                // Crops already saved from a failed deck still get rendered
+                if (renderer) {
+                    renderer->close();
+                    closing.emplace_back(&deck, std::move(renderer));
+                }
+                if (!finished) break;
+            }
+        }
+
+        // Finish queued crops and OCR work (the GUI may have queued plenty)
+        // before exiting, all within the same deadline
+        const auto deadline = std::chrono::steady_clock::now() + cmd.drain_timeout;
+        for (auto &[deck, renderer] : closing) {
+            if (std::size_t dropped = renderer->finish_crops(deadline)) {
+                std::cout << "[Crop] " << deck->pdf.filename().string() << ": " << dropped
+                          << " crops not rendered by the drain deadline; --headless re-extracts them from "
+                          << (deck->out_dir / "boxes.json").string() << "\n";
+            }
+            renderer.reset();
+        }
+        ocr.drain(deadline);
+        std::cout << "[Memory] Peak " << (memory_budget().peak() >> 20) << " MB";
+        if (cmd.memory_bytes > 0) std::cout << " of " << (cmd.memory_bytes >> 20) << " MB budget";
+        std::cout << "\n";
         std::cout << "All done. Bye!\n";
     } catch (const std::exception &ex) {
         std::cerr << "Error: " << ex.what() << "\n";